@@ -17,6 +17,36 @@ static CCriticalSection cs_db;
 static bool fDbEnvInit = false;
 DbEnv dbenv(0);
 static map<string, int> mapFileUseCount;
+int64 nBatchCommits = 0;
+int64 nBatchCommitMicros = 0;
+int64 nBatchCommitMicrosMax = 0;
+int nTxDBStore = DBSTORE_BDB;
+int nLogDBSync = BLOCKFILESYNC_BLOCK;
+
+// Checkpoint schedule, by whichever comes first
+int nDBCheckpointInterval = 5 * 60;
+int nDBCheckpointLogSize = 8 * 1024 * 1024;
+string strDBLogArchiveDir;
+
+static CCriticalSection cs_dbCheckpoint;
+static int64 nLastCheckpoint = 0;
+int64 nDBCheckpoints = 0;
+int64 nDBCheckpointMicros = 0;
+int64 nDBCheckpointMicrosMax = 0;
+int64 nDBCheckpointMicrosLast = 0;
+int64 nDBLogFiles = 0;
+int64 nDBLogBytes = 0;
+
+// Cache, lock table and log file sizing, 0 cache leaves Berkeley DB's default
+int64 nDBCacheSize = 0;
+int nDBMaxLocks = 10000;
+int nDBLogFileSize = 10000000;
+int nDBStatsInterval = 0;
+
+static CCriticalSection cs_dbStats;
+static map<string, CDBFileStats> mapDBFileStats;
+
+void ThreadDBCheckpoint(void* parg);
 
 class CDBInit
 {
@@ -36,7 +66,891 @@ public:
 instance_of_cdbinit;
 
 
-CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
+static void InitDbEnv()
+{
+    // Called with cs_db held
+    if (fDbEnvInit)
+        return;
+
+    string strAppDir = GetAppDir();
+    string strLogDir = strAppDir + "\\database";
+    _mkdir(strLogDir.c_str());
+    printf("dbenv.open strAppDir=%s\n", strAppDir.c_str());
+
+    dbenv.set_lg_dir(strLogDir.c_str());
+    dbenv.set_lg_max(nDBLogFileSize);
+    dbenv.set_lk_max_locks(nDBMaxLocks);
+    dbenv.set_lk_max_objects(nDBMaxLocks);
+    if (nDBCacheSize > 0)
+        dbenv.set_cachesize((u_int32_t)(nDBCacheSize >> 30), (u_int32_t)(nDBCacheSize & 0x3fffffff), 1);
+    dbenv.set_errfile(fopen("db.log", "a")); /// debug
+    ///dbenv.log_set_config(DB_LOG_AUTO_REMOVE, 1); /// causes corruption
+    int ret = dbenv.open(strAppDir.c_str(),
+                         DB_CREATE     |
+                         DB_INIT_LOCK  |
+                         DB_INIT_LOG   |
+                         DB_INIT_MPOOL |
+                         DB_INIT_TXN   |
+                         DB_THREAD     |
+                         DB_PRIVATE    |
+                         DB_RECOVER,
+                         0);
+    if (ret > 0)
+        throw runtime_error(strprintf("CDB() : error %d opening database environment\n", ret));
+    fDbEnvInit = true;
+    nLastCheckpoint = GetTime();
+
+    static bool fCheckpointThread;
+    if (!fCheckpointThread)
+    {
+        fCheckpointThread = true;
+        if (_beginthread(ThreadDBCheckpoint, 0, NULL) == -1)
+            printf("Error: _beginthread(ThreadDBCheckpoint) failed\n");
+    }
+}
+
+
+
+
+//
+// Berkeley DB store
+//
+
+class CBerkeleyCursor : public CDBCursor
+{
+protected:
+    Dbc* pcursor;
+
+public:
+    CBerkeleyCursor(Dbc* pcursorIn) : pcursor(pcursorIn) { }
+    ~CBerkeleyCursor() { pcursor->close(); }
+
+    int Get(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        // Read at cursor
+        Dbt datKey;
+        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+        {
+            datKey.set_data(&ssKey[0]);
+            datKey.set_size(ssKey.size());
+        }
+        Dbt datValue;
+        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+        {
+            datValue.set_data(&ssValue[0]);
+            datValue.set_size(ssValue.size());
+        }
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        if (ret != 0)
+            return ret;
+        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+            return 99999;
+
+        // Convert to streams
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        return 0;
+    }
+};
+
+class CBerkeleyStore : public CDBStore
+{
+protected:
+    Db* pdb;
+    vector<DbTxn*> vTxn;
+
+    DbTxn* GetTxn()
+    {
+        if (!vTxn.empty())
+            return vTxn.back();
+        else
+            return NULL;
+    }
+
+public:
+    CBerkeleyStore(Db* pdbIn) : pdb(pdbIn) { }
+
+    ~CBerkeleyStore()
+    {
+        if (!vTxn.empty())
+            vTxn.front()->abort();
+        vTxn.clear();
+        pdb->close(0);
+        delete pdb;
+    }
+
+    int Get(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
+        if (datValue.get_data() == NULL)
+            return (ret == 0 ? DB_NOTFOUND : ret);
+
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datValue.get_data());
+        return ret;
+    }
+
+    int Put(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue((void*)&ssValue[0], ssValue.size());
+        return pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+    }
+
+    int Del(const CDataStream& ssKey)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        return pdb->del(GetTxn(), &datKey, 0);
+    }
+
+    int Exists(const CDataStream& ssKey)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        return pdb->exists(GetTxn(), &datKey, 0);
+    }
+
+    CDBCursor* GetCursor()
+    {
+        Dbc* pcursor = NULL;
+        int ret = pdb->cursor(NULL, &pcursor, 0);
+        if (ret != 0)
+            return NULL;
+        return new CBerkeleyCursor(pcursor);
+    }
+
+    bool WriteBatch(const CDBBatch& batch)
+    {
+        // Apply in key order so the btree is walked front to back once
+        bool fOk = TxnBegin();
+        for (CDBBatch::map_type::const_iterator mi = batch.mapWrite.begin(); fOk && mi != batch.mapWrite.end(); ++mi)
+        {
+            const vector<unsigned char>& vchKey = (*mi).first;
+            Dbt datKey((void*)&vchKey[0], vchKey.size());
+            if ((*mi).second.first)
+            {
+                int ret = pdb->del(GetTxn(), &datKey, 0);
+                fOk = (ret == 0 || ret == DB_NOTFOUND);
+            }
+            else
+            {
+                const vector<unsigned char>& vchValue = (*mi).second.second;
+                Dbt datValue((void*)&vchValue[0], vchValue.size());
+                fOk = (pdb->put(GetTxn(), &datKey, &datValue, 0) == 0);
+            }
+        }
+        if (fOk)
+            fOk = TxnCommit();
+        else if (!vTxn.empty())
+            TxnAbort();
+        return fOk;
+    }
+
+    bool TxnBegin()
+    {
+        DbTxn* ptxn = NULL;
+        int ret = dbenv.txn_begin(GetTxn(), &ptxn, 0);
+        if (!ptxn || ret != 0)
+            return false;
+        vTxn.push_back(ptxn);
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (vTxn.empty())
+            return false;
+        int ret = vTxn.back()->commit(0);
+        vTxn.pop_back();
+        return (ret == 0);
+    }
+
+    bool TxnAbort()
+    {
+        if (vTxn.empty())
+            return false;
+        int ret = vTxn.back()->abort();
+        vTxn.pop_back();
+        return (ret == 0);
+    }
+};
+
+
+
+
+//
+// Log-structured store
+//
+// The file is a run of records, one per write batch: nSize and nChecksum,
+// then nSize bytes of entries, each fErase, nKeySize, nValueSize, key and
+// value.  Only the key and where its value is are kept in memory.  Loading
+// stops at the first record that doesn't check out, which is where a write
+// was cut off, and the file is cut back to there.  Once most of the file is
+// dead values, a background thread copies the live ones to a new file.
+//
+
+static const unsigned int LOGRECORD_HEADER_SIZE = 8;
+static const unsigned int LOGENTRY_HEADER_SIZE = 9;
+
+class CLogFile
+{
+public:
+    // key -> (position, size) of its value
+    typedef map<vector<unsigned char>, pair<int64, unsigned int> > index_type;
+
+    CCriticalSection cs;
+    string strPath;
+    HANDLE hFile;
+    int64 nEnd;
+    int64 nLiveBytes;
+    index_type mapIndex;
+    int64 nLastSync;
+    bool fCompacting;
+
+    CLogFile(const string& strPathIn)
+    {
+        strPath = strPathIn;
+        hFile = INVALID_HANDLE_VALUE;
+        nEnd = 0;
+        nLiveBytes = 0;
+        nLastSync = 0;
+        fCompacting = false;
+    }
+
+    bool Open();
+    void Close();
+    int Read(const vector<unsigned char>& vchKey, CDataStream& ssValue);
+    int ReadValue(const pair<int64, unsigned int>& pos, CDataStream& ssValue);
+    bool Append(const CDBBatch& batch);
+    bool Sync();
+    bool Compact();
+};
+
+static bool ReadAt(HANDLE hFile, int64 nPos, void* pbuf, unsigned int nSize)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)nPos;
+    overlapped.OffsetHigh = (DWORD)(nPos >> 32);
+    DWORD nRead = 0;
+    return (ReadFile(hFile, pbuf, nSize, &nRead, &overlapped) && nRead == nSize);
+}
+
+static bool WriteAt(HANDLE hFile, int64 nPos, const void* pbuf, unsigned int nSize)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)nPos;
+    overlapped.OffsetHigh = (DWORD)(nPos >> 32);
+    DWORD nWritten = 0;
+    return (WriteFile(hFile, pbuf, nSize, &nWritten, &overlapped) && nWritten == nSize);
+}
+
+static unsigned int LogChecksum(const unsigned char* pbegin, const unsigned char* pend)
+{
+    return (unsigned int)Hash(pbegin, pend).Get64();
+}
+
+static void AddLogEntry(vector<unsigned char>& vchRecord, bool fErase, const vector<unsigned char>& vchKey, const vector<unsigned char>& vchValue)
+{
+    unsigned int nKeySize = vchKey.size();
+    unsigned int nValueSize = (fErase ? 0 : vchValue.size());
+    unsigned int nPos = vchRecord.size();
+    vchRecord.resize(nPos + LOGENTRY_HEADER_SIZE + nKeySize + nValueSize);
+    vchRecord[nPos] = fErase;
+    memcpy(&vchRecord[nPos+1], &nKeySize, 4);
+    memcpy(&vchRecord[nPos+5], &nValueSize, 4);
+    if (nKeySize)
+        memcpy(&vchRecord[nPos+LOGENTRY_HEADER_SIZE], &vchKey[0], nKeySize);
+    if (nValueSize)
+        memcpy(&vchRecord[nPos+LOGENTRY_HEADER_SIZE+nKeySize], &vchValue[0], nValueSize);
+}
+
+static bool CheckLogRecord(const unsigned char* pbegin, unsigned int nSize)
+{
+    unsigned int nPos = 0;
+    while (nPos < nSize)
+    {
+        if (nSize - nPos < LOGENTRY_HEADER_SIZE)
+            return false;
+        unsigned int nKeySize, nValueSize;
+        memcpy(&nKeySize, &pbegin[nPos+1], 4);
+        memcpy(&nValueSize, &pbegin[nPos+5], 4);
+        nPos += LOGENTRY_HEADER_SIZE;
+        if (nKeySize > nSize - nPos || nValueSize > nSize - nPos - nKeySize)
+            return false;
+        nPos += nKeySize + nValueSize;
+    }
+    return true;
+}
+
+static void IndexLogRecord(const unsigned char* pbegin, unsigned int nSize, int64 nPayloadPos, CLogFile::index_type& mapIndex, int64& nLiveBytes)
+{
+    // The record has been through CheckLogRecord or was just built
+    unsigned int nPos = 0;
+    while (nPos < nSize)
+    {
+        bool fErase = pbegin[nPos];
+        unsigned int nKeySize, nValueSize;
+        memcpy(&nKeySize, &pbegin[nPos+1], 4);
+        memcpy(&nValueSize, &pbegin[nPos+5], 4);
+        nPos += LOGENTRY_HEADER_SIZE;
+
+        vector<unsigned char> vchKey(pbegin + nPos, pbegin + nPos + nKeySize);
+        CLogFile::index_type::iterator mi = mapIndex.find(vchKey);
+        if (mi != mapIndex.end())
+            nLiveBytes -= LOGENTRY_HEADER_SIZE + nKeySize + (*mi).second.second;
+        if (fErase)
+        {
+            if (mi != mapIndex.end())
+                mapIndex.erase(mi);
+        }
+        else
+        {
+            mapIndex[vchKey] = make_pair(nPayloadPos + nPos + nKeySize, nValueSize);
+            nLiveBytes += LOGENTRY_HEADER_SIZE + nKeySize + nValueSize;
+        }
+        nPos += nKeySize + nValueSize;
+    }
+}
+
+static bool FlushLogRecord(HANDLE hFile, vector<unsigned char>& vchRecord, int64& nEnd, CLogFile::index_type& mapIndex, int64& nLiveBytes)
+{
+    // vchRecord starts with room for the header
+    unsigned int nSize = vchRecord.size() - LOGRECORD_HEADER_SIZE;
+    unsigned int nChecksum = LogChecksum(&vchRecord[0] + LOGRECORD_HEADER_SIZE, &vchRecord[0] + vchRecord.size());
+    memcpy(&vchRecord[0], &nSize, 4);
+    memcpy(&vchRecord[4], &nChecksum, 4);
+    if (!WriteAt(hFile, nEnd, &vchRecord[0], vchRecord.size()))
+        return error("FlushLogRecord() : WriteFile failed %d", GetLastError());
+    IndexLogRecord(&vchRecord[0] + LOGRECORD_HEADER_SIZE, nSize, nEnd + LOGRECORD_HEADER_SIZE, mapIndex, nLiveBytes);
+    nEnd += vchRecord.size();
+    vchRecord.resize(LOGRECORD_HEADER_SIZE);
+    return true;
+}
+
+static void LoadLogRecords(HANDLE hFile, int64 nFrom, int64 nFileSize, CLogFile::index_type& mapIndex, int64& nLiveBytes, int64& nEndRet)
+{
+    int64 nPos = nFrom;
+    vector<unsigned char> vchPayload;
+    while (nFileSize - nPos >= LOGRECORD_HEADER_SIZE)
+    {
+        unsigned int nHeader[2];
+        if (!ReadAt(hFile, nPos, nHeader, sizeof(nHeader)))
+            break;
+        unsigned int nSize = nHeader[0];
+        if (nSize > 0x40000000 || nSize > nFileSize - nPos - LOGRECORD_HEADER_SIZE)
+            break;
+        vchPayload.resize(nSize);
+        if (nSize && !ReadAt(hFile, nPos + LOGRECORD_HEADER_SIZE, &vchPayload[0], nSize))
+            break;
+        if (nSize && (LogChecksum(&vchPayload[0], &vchPayload[0] + nSize) != nHeader[1] ||
+                      !CheckLogRecord(&vchPayload[0], nSize)))
+            break;
+        if (nSize)
+            IndexLogRecord(&vchPayload[0], nSize, nPos + LOGRECORD_HEADER_SIZE, mapIndex, nLiveBytes);
+        nPos += LOGRECORD_HEADER_SIZE + nSize;
+    }
+    nEndRet = nPos;
+}
+
+bool CLogFile::Open()
+{
+    // A compaction that got as far as removing the old file
+    string strPathNew = strPath + ".new";
+    FILE* file = fopen(strPath.c_str(), "rb");
+    if (file)
+        fclose(file);
+    else
+        rename(strPathNew.c_str(), strPath.c_str());
+    remove(strPathNew.c_str());
+
+    hFile = CreateFile(strPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return error("CLogFile::Open() : CreateFile %s failed %d", strPath.c_str(), GetLastError());
+    DWORD nSizeHigh = 0;
+    DWORD nSizeLow = GetFileSize(hFile, &nSizeHigh);
+    if (nSizeLow == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+    {
+        CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+        return error("CLogFile::Open() : GetFileSize %s failed", strPath.c_str());
+    }
+    int64 nFileSize = ((int64)nSizeHigh << 32) | nSizeLow;
+
+    int64 nStart = GetTimeMicros();
+    LoadLogRecords(hFile, 0, nFileSize, mapIndex, nLiveBytes, nEnd);
+    if (nEnd < nFileSize)
+    {
+        printf("CLogFile::Open() : dropping %I64d bytes of a partly written record\n", nFileSize - nEnd);
+        LONG nHigh = (LONG)(nEnd >> 32);
+        if (SetFilePointer(hFile, (LONG)nEnd, &nHigh, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
+            return error("CLogFile::Open() : SetFilePointer failed %d", GetLastError());
+        SetEndOfFile(hFile);
+    }
+    nLastSync = GetTime();
+    printf("CLogFile::Open(%s) : %d keys, %I64d of %I64d bytes live, %I64dus\n", strPath.c_str(), mapIndex.size(), nLiveBytes, nEnd, GetTimeMicros() - nStart);
+    return true;
+}
+
+void CLogFile::Close()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (hFile != INVALID_HANDLE_VALUE)
+        {
+            FlushFileBuffers(hFile);
+            CloseHandle(hFile);
+            hFile = INVALID_HANDLE_VALUE;
+        }
+        mapIndex.clear();
+    }
+}
+
+int CLogFile::ReadValue(const pair<int64, unsigned int>& pos, CDataStream& ssValue)
+{
+    // Called with cs held
+    ssValue.clear();
+    ssValue.resize(pos.second);
+    if (pos.second && !ReadAt(hFile, pos.first, &ssValue[0], pos.second))
+        return EIO;
+    return 0;
+}
+
+int CLogFile::Read(const vector<unsigned char>& vchKey, CDataStream& ssValue)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (hFile == INVALID_HANDLE_VALUE)
+            return EINVAL;
+        index_type::iterator mi = mapIndex.find(vchKey);
+        if (mi == mapIndex.end())
+            return DB_NOTFOUND;
+        return ReadValue((*mi).second, ssValue);
+    }
+    return EINVAL;
+}
+
+bool CLogFile::Append(const CDBBatch& batch)
+{
+    vector<unsigned char> vchRecord(LOGRECORD_HEADER_SIZE);
+    for (CDBBatch::map_type::const_iterator mi = batch.mapWrite.begin(); mi != batch.mapWrite.end(); ++mi)
+        AddLogEntry(vchRecord, (*mi).second.first, (*mi).first, (*mi).second.second);
+    if (vchRecord.size() == LOGRECORD_HEADER_SIZE)
+        return true;
+
+    CRITICAL_BLOCK(cs)
+    {
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        if (!FlushLogRecord(hFile, vchRecord, nEnd, mapIndex, nLiveBytes))
+            return false;
+
+        if (nLogDBSync == BLOCKFILESYNC_BLOCK ||
+            (nLogDBSync == BLOCKFILESYNC_PERIODIC && GetTime() - nLastSync >= 60))
+        {
+            if (!FlushFileBuffers(hFile))
+                return error("CLogFile::Append() : FlushFileBuffers failed %d", GetLastError());
+            nLastSync = GetTime();
+        }
+    }
+    return true;
+}
+
+bool CLogFile::Sync()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (hFile == INVALID_HANDLE_VALUE || !FlushFileBuffers(hFile))
+            return false;
+        nLastSync = GetTime();
+    }
+    return true;
+}
+
+bool CLogFile::Compact()
+{
+    // Values before nFrom don't move while they're copied
+    vector<pair<vector<unsigned char>, pair<int64, unsigned int> > > vEntry;
+    int64 nFrom = 0;
+    int64 nSizeBefore = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        if (hFile == INVALID_HANDLE_VALUE || fCompacting)
+            return false;
+        fCompacting = true;
+        vEntry.assign(mapIndex.begin(), mapIndex.end());
+        nFrom = nEnd;
+        nSizeBefore = nEnd;
+    }
+    int64 nStart = GetTimeMicros();
+
+    string strPathNew = strPath + ".new";
+    HANDLE hRead = CreateFile(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    // Shared for delete so it can be moved into place while open
+    HANDLE hNew = CreateFile(strPathNew.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool fOk = (hRead != INVALID_HANDLE_VALUE && hNew != INVALID_HANDLE_VALUE);
+
+    // Copy the live values in key order, a megabyte to a record
+    index_type mapIndexNew;
+    int64 nLiveNew = 0;
+    int64 nEndNew = 0;
+    vector<unsigned char> vchRecord(LOGRECORD_HEADER_SIZE);
+    vector<unsigned char> vchValue;
+    for (int i = 0; fOk && i < vEntry.size(); i++)
+    {
+        vchValue.resize(vEntry[i].second.second);
+        if (!vchValue.empty() && !ReadAt(hRead, vEntry[i].second.first, &vchValue[0], vchValue.size()))
+            fOk = false;
+        else
+            AddLogEntry(vchRecord, false, vEntry[i].first, vchValue);
+        if (fOk && (vchRecord.size() >= 1000000 || i == vEntry.size()-1))
+            fOk = FlushLogRecord(hNew, vchRecord, nEndNew, mapIndexNew, nLiveNew);
+    }
+    vEntry.clear();
+
+    CRITICAL_BLOCK(cs)
+    {
+        // Bring over what was appended while we copied
+        if (fOk && hFile != INVALID_HANDLE_VALUE)
+        {
+            int64 nTailEnd = nEndNew + (nEnd - nFrom);
+            for (int64 nPos = nFrom; fOk && nPos < nEnd; )
+            {
+                unsigned int nChunk = (unsigned int)min(nEnd - nPos, (int64)1000000);
+                vchValue.resize(nChunk);
+                fOk = (ReadAt(hFile, nPos, &vchValue[0], nChunk) &&
+                       WriteAt(hNew, nEndNew + (nPos - nFrom), &vchValue[0], nChunk));
+                nPos += nChunk;
+            }
+            if (fOk)
+            {
+                LoadLogRecords(hNew, nEndNew, nTailEnd, mapIndexNew, nLiveNew, nEndNew);
+                fOk = (nEndNew == nTailEnd && FlushFileBuffers(hNew));
+            }
+        }
+        else
+        {
+            fOk = false;
+        }
+        if (hRead != INVALID_HANDLE_VALUE)
+            CloseHandle(hRead);
+
+        // Swap it in.  The old file can't be replaced while it's open, if
+        // the move fails it is still there to reopen.  The new handle
+        // follows its file through the move.
+        if (fOk)
+        {
+            CloseHandle(hFile);
+            if (MoveFileEx(strPathNew.c_str(), strPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+            {
+                hFile = hNew;
+                hNew = INVALID_HANDLE_VALUE;
+                mapIndex.swap(mapIndexNew);
+                nEnd = nEndNew;
+                nLiveBytes = nLiveNew;
+            }
+            else
+            {
+                printf("ERROR: CLogFile::Compact() : MoveFileEx %s failed %d\n", strPathNew.c_str(), GetLastError());
+                fOk = false;
+                hFile = CreateFile(strPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (hFile == INVALID_HANDLE_VALUE)
+                    printf("ERROR: CLogFile::Compact() : reopening %s failed %d\n", strPath.c_str(), GetLastError());
+            }
+        }
+        if (hNew != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hNew);
+            remove(strPathNew.c_str());
+        }
+        fCompacting = false;
+    }
+
+    printf("CLogFile::Compact(%s) : %s, %I64d -> %I64d bytes, %I64dms\n", strPath.c_str(), fOk ? "done" : "FAILED", nSizeBefore, nEndNew, (GetTimeMicros() - nStart) / 1000);
+    return fOk;
+}
+
+class CLogCursor : public CDBCursor
+{
+protected:
+    CLogFile* plog;
+    vector<unsigned char> vchLast;
+    bool fPositioned;
+
+public:
+    CLogCursor(CLogFile* plogIn) : plog(plogIn), fPositioned(false) { }
+
+    int Get(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        // Positioned by key rather than iterator, so writes in between are fine
+        vector<unsigned char> vchKey(ssKey.begin(), ssKey.end());
+        CRITICAL_BLOCK(plog->cs)
+        {
+            CLogFile::index_type::iterator mi;
+            if (fFlags == DB_SET)
+                mi = plog->mapIndex.find(vchKey);
+            else if (fFlags == DB_SET_RANGE)
+                mi = plog->mapIndex.lower_bound(vchKey);
+            else if (fFlags == DB_NEXT)
+                mi = (fPositioned ? plog->mapIndex.upper_bound(vchLast) : plog->mapIndex.begin());
+            else
+                return EINVAL;
+            if (mi == plog->mapIndex.end())
+                return DB_NOTFOUND;
+
+            int ret = plog->ReadValue((*mi).second, ssValue);
+            if (ret != 0)
+                return ret;
+            vchLast = (*mi).first;
+            fPositioned = true;
+        }
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)&vchLast[0], vchLast.size());
+        ssValue.SetType(SER_DISK);
+        return 0;
+    }
+};
+
+class CLogStore : public CDBStore
+{
+protected:
+    CLogFile* plog;
+
+    // Open transactions, innermost last
+    vector<CDBBatch> vTxn;
+
+    int FindInTxn(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        for (int i = vTxn.size()-1; i >= 0; i--)
+        {
+            int nFound = vTxn[i].Find(ssKey, ssValue);
+            if (nFound != -1)
+                return nFound;
+        }
+        return -1;
+    }
+
+public:
+    CLogStore(CLogFile* plogIn) : plog(plogIn) { }
+
+    int Get(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        int nFound = FindInTxn(ssKey, ssValue);
+        if (nFound != -1)
+            return (nFound == 1 ? 0 : DB_NOTFOUND);
+        return plog->Read(vector<unsigned char>(ssKey.begin(), ssKey.end()), ssValue);
+    }
+
+    int Put(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+    {
+        if (!fOverwrite && Exists(ssKey) == 0)
+            return DB_KEYEXIST;
+        CDBBatch batch;
+        batch.Write(ssKey, ssValue);
+        return (WriteBatch(batch) ? 0 : EIO);
+    }
+
+    int Del(const CDataStream& ssKey)
+    {
+        CDBBatch batch;
+        batch.Erase(ssKey);
+        return (WriteBatch(batch) ? 0 : EIO);
+    }
+
+    int Exists(const CDataStream& ssKey)
+    {
+        CDataStream ssValue(SER_DISK);
+        return Get(ssKey, ssValue);
+    }
+
+    CDBCursor* GetCursor()
+    {
+        return new CLogCursor(plog);
+    }
+
+    bool WriteBatch(const CDBBatch& batch)
+    {
+        if (!vTxn.empty())
+        {
+            vTxn.back().Merge(batch);
+            return true;
+        }
+        return plog->Append(batch);
+    }
+
+    bool TxnBegin()
+    {
+        vTxn.push_back(CDBBatch());
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (vTxn.empty())
+            return false;
+        CDBBatch batch;
+        batch.mapWrite.swap(vTxn.back().mapWrite);
+        vTxn.pop_back();
+        return WriteBatch(batch);
+    }
+
+    bool TxnAbort()
+    {
+        if (vTxn.empty())
+            return false;
+        vTxn.pop_back();
+        return true;
+    }
+};
+
+static map<string, CLogFile*> mapLogFile;
+
+void ThreadLogFileCompact(void* parg)
+{
+    loop
+    {
+        Sleep(60 * 1000);
+        if (fShutdown)
+            return;
+
+        vector<CLogFile*> vLogFile;
+        CRITICAL_BLOCK(cs_db)
+            foreach(const PAIRTYPE(string, CLogFile*)& item, mapLogFile)
+                vLogFile.push_back(item.second);
+
+        // Once more than half of it is dead
+        foreach(CLogFile* plog, vLogFile)
+        {
+            bool fCompact = false;
+            CRITICAL_BLOCK(plog->cs)
+                fCompact = (plog->hFile != INVALID_HANDLE_VALUE && plog->nEnd > 16 * 1024 * 1024 && plog->nLiveBytes < plog->nEnd / 2);
+            if (fCompact)
+                plog->Compact();
+        }
+    }
+}
+
+static bool CopyFromBerkeley(const string& strFile, CLogFile* plog)
+{
+    // Called with cs_db held, the first time a file is kept in a log store
+    FILE* file = fopen((GetAppDir() + "\\" + strFile).c_str(), "rb");
+    if (!file)
+        return true;
+    fclose(file);
+
+    InitDbEnv();
+    Db* pdb = new Db(&dbenv, 0);
+    int ret = pdb->open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY | DB_THREAD, 0);
+    if (ret != 0)
+    {
+        delete pdb;
+        return error("CopyFromBerkeley(%s) : open failed %d", strFile.c_str(), ret);
+    }
+    CBerkeleyStore store(pdb);
+    CDBCursor* pcursor = store.GetCursor();
+    if (!pcursor)
+        return error("CopyFromBerkeley(%s) : GetCursor failed", strFile.c_str());
+
+    CDBBatch batch;
+    int nCount = 0;
+    loop
+    {
+        CDataStream ssKey(SER_DISK);
+        CDataStream ssValue(SER_DISK);
+        ret = pcursor->Get(ssKey, ssValue, DB_NEXT);
+        if (ret != 0)
+            break;
+        batch.Write(ssKey, ssValue);
+        nCount++;
+        if (batch.mapWrite.size() >= 10000)
+        {
+            if (!plog->Append(batch))
+            {
+                pcursor->close();
+                return error("CopyFromBerkeley(%s) : Append failed after %d records", strFile.c_str(), nCount);
+            }
+            batch.mapWrite.clear();
+        }
+    }
+    pcursor->close();
+    if (ret != DB_NOTFOUND)
+        return error("CopyFromBerkeley(%s) : cursor failed %d after %d records", strFile.c_str(), ret, nCount);
+    if (!plog->Append(batch) || !plog->Sync())
+        return error("CopyFromBerkeley(%s) : Append failed after %d records", strFile.c_str(), nCount);
+    printf("CopyFromBerkeley(%s) : copied %d records\n", strFile.c_str(), nCount);
+    return true;
+}
+
+static CLogFile* OpenLogFile(const string& strFile)
+{
+    CRITICAL_BLOCK(cs_db)
+    {
+        map<string, CLogFile*>::iterator mi = mapLogFile.find(strFile);
+        if (mi != mapLogFile.end())
+            return (*mi).second;
+
+        // blkindex.dat is kept in blkindex.logdb
+        string strPath = GetAppDir() + "\\" + strFile.substr(0, strFile.find('.')) + ".logdb";
+        FILE* file = fopen(strPath.c_str(), "rb");
+        if (!file)
+            file = fopen((strPath + ".new").c_str(), "rb");
+        bool fNew = (file == NULL);
+        if (file)
+            fclose(file);
+
+        CLogFile* plog = new CLogFile(strPath);
+        if (!plog->Open())
+        {
+            delete plog;
+            return NULL;
+        }
+        mapLogFile[strFile] = plog;
+        if (fNew && !CopyFromBerkeley(strFile, plog))
+        {
+            // Stay off the log store, the next start tries again
+            mapLogFile.erase(strFile);
+            plog->Close();
+            delete plog;
+            remove(strPath.c_str());
+            return NULL;
+        }
+
+        if (mapLogFile.size() == 1)
+            if (_beginthread(ThreadLogFileCompact, 0, NULL) == -1)
+                printf("Error: _beginthread(ThreadLogFileCompact) failed\n");
+        return plog;
+    }
+    return NULL;
+}
+
+
+
+
+//
+// CDB
+//
+
+CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn, int nStoreIn) : pstore(NULL), pbatch(NULL), nStore(nStoreIn)
 {
     int ret;
     if (pszFile == NULL)
@@ -52,57 +966,41 @@ CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
     if (!fReadOnly || fTxn)
         nFlags |= DB_AUTO_COMMIT;
 
-    CRITICAL_BLOCK(cs_db)
+    if (nStore == DBSTORE_LOG)
     {
-        if (!fDbEnvInit)
-        {
-            string strAppDir = GetAppDir();
-            string strLogDir = strAppDir + "\\database";
-            _mkdir(strLogDir.c_str());
-            printf("dbenv.open strAppDir=%s\n", strAppDir.c_str());
-
-            dbenv.set_lg_dir(strLogDir.c_str());
-            dbenv.set_lg_max(10000000);
-            dbenv.set_lk_max_locks(10000);
-            dbenv.set_lk_max_objects(10000);
-            dbenv.set_errfile(fopen("db.log", "a")); /// debug
-            ///dbenv.log_set_config(DB_LOG_AUTO_REMOVE, 1); /// causes corruption
-            ret = dbenv.open(strAppDir.c_str(),
-                             DB_CREATE     |
-                             DB_INIT_LOCK  |
-                             DB_INIT_LOG   |
-                             DB_INIT_MPOOL |
-                             DB_INIT_TXN   |
-                             DB_THREAD     |
-                             DB_PRIVATE    |
-                             DB_RECOVER,
-                             0);
-            if (ret > 0)
-                throw runtime_error(strprintf("CDB() : error %d opening database environment\n", ret));
-            fDbEnvInit = true;
-        }
-
+        CLogFile* plog = OpenLogFile(pszFile);
+        if (!plog)
+            throw runtime_error(strprintf("CDB() : can't open log store for %s\n", pszFile));
         strFile = pszFile;
-        ++mapFileUseCount[strFile];
+        pstore = new CLogStore(plog);
     }
+    else
+    {
+        CRITICAL_BLOCK(cs_db)
+        {
+            InitDbEnv();
+            strFile = pszFile;
+            ++mapFileUseCount[strFile];
+        }
 
-    pdb = new Db(&dbenv, 0);
+        Db* pdb = new Db(&dbenv, 0);
 
-    ret = pdb->open(NULL,      // Txn pointer
-                    pszFile,   // Filename
-                    "main",    // Logical db name
-                    DB_BTREE,  // Database type
-                    nFlags,    // Flags
-                    0);
+        ret = pdb->open(NULL,      // Txn pointer
+                        pszFile,   // Filename
+                        "main",    // Logical db name
+                        DB_BTREE,  // Database type
+                        nFlags,    // Flags
+                        0);
 
-    if (ret > 0)
-    {
-        delete pdb;
-        pdb = NULL;
-        CRITICAL_BLOCK(cs_db)
-            --mapFileUseCount[strFile];
-        strFile = "";
-        throw runtime_error(strprintf("CDB() : can't open database file %s, error %d\n", pszFile, ret));
+        if (ret > 0)
+        {
+            delete pdb;
+            CRITICAL_BLOCK(cs_db)
+                --mapFileUseCount[strFile];
+            strFile = "";
+            throw runtime_error(strprintf("CDB() : can't open database file %s, error %d\n", pszFile, ret));
+        }
+        pstore = new CBerkeleyStore(pdb);
     }
 
     if (fCreate && !Exists(string("version")))
@@ -113,20 +1011,254 @@ CDB::CDB(const char* pszFile, const char* pszMode, bool fTxn) : pdb(NULL)
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pstore)
         return;
-    if (!vTxn.empty())
-        vTxn.front()->abort();
-    vTxn.clear();
-    pdb->close(0);
-    delete pdb;
-    pdb = NULL;
+    if (pbatch)
+        BatchAbort();
+    delete pstore;
+    pstore = NULL;
+
+    if (nDBStatsInterval > 0)
+    {
+        CRITICAL_BLOCK(cs_dbStats)
+        {
+            CDBFileStats& total = mapDBFileStats[strFile];
+            for (int nOp = 0; nOp < DBOP_MAX; nOp++)
+            {
+                total.nCount[nOp] += stats.nCount[nOp];
+                total.nMicros[nOp] += stats.nMicros[nOp];
+                total.nMicrosMax[nOp] = max(total.nMicrosMax[nOp], stats.nMicrosMax[nOp]);
+            }
+        }
+        stats = CDBFileStats();
+    }
+
+    // Checkpoints are left to ThreadDBCheckpoint
+    if (nStore == DBSTORE_BDB)
+        CRITICAL_BLOCK(cs_db)
+            --mapFileUseCount[strFile];
+
+    RandAddSeed();
+}
+
+void CDB::RecordOp(int nOp, int64 nStart)
+{
+    if (nStart == 0)
+        return;
+    int64 nTime = GetTimeMicros() - nStart;
+    stats.nCount[nOp]++;
+    stats.nMicros[nOp] += nTime;
+    if (nTime > stats.nMicrosMax[nOp])
+        stats.nMicrosMax[nOp] = nTime;
+}
+
+bool CDB::BatchBegin()
+{
+    if (!pstore || pbatch)
+        return false;
+    pbatch = new CDBBatch();
+    return true;
+}
+
+bool CDB::BatchAbort()
+{
+    if (!pbatch)
+        return false;
+    delete pbatch;
+    pbatch = NULL;
+    return true;
+}
+
+bool CDB::BatchCommit()
+{
+    if (!pstore || !pbatch)
+        return false;
+    int64 nStart = GetTimeMicros();
+
+    // Detach the batch so the writes below go to the database
+    auto_ptr<CDBBatch> pbatchCommit(pbatch);
+    pbatch = NULL;
+
+    int nWrites = 0;
+    int nErases = 0;
+    for (CDBBatch::map_type::iterator mi = pbatchCommit->mapWrite.begin(); mi != pbatchCommit->mapWrite.end(); ++mi)
+    {
+        if ((*mi).second.first)
+            nErases++;
+        else
+            nWrites++;
+    }
+    bool fOk = pstore->WriteBatch(*pbatchCommit);
+    RecordOp(DBOP_BATCH, nStart);
+
+    int64 nTime = GetTimeMicros() - nStart;
+    nBatchCommits++;
+    nBatchCommitMicros += nTime;
+    nBatchCommitMicrosMax = max(nBatchCommitMicrosMax, nTime);
+    if (!fOk || fDebug)
+        printf("BatchCommit(%s) : %d writes, %d erases, %I64d us%s\n", strFile.c_str(), nWrites, nErases, nTime, fOk ? "" : " FAILED");
+    return fOk;
+}
+
+static void DBCheckpoint()
+{
+    // Called with cs_dbCheckpoint held
+    int64 nStart = GetTimeMicros();
     dbenv.txn_checkpoint(0, 0, 0);
+    int64 nTime = GetTimeMicros() - nStart;
+    nDBCheckpoints++;
+    nDBCheckpointMicros += nTime;
+    nDBCheckpointMicrosMax = max(nDBCheckpointMicrosMax, nTime);
+    nDBCheckpointMicrosLast = nTime;
+    nLastCheckpoint = GetTime();
+}
+
+static int64 GetLogBytesSinceCheckpoint()
+{
+    DB_LOG_STAT* plogstat = NULL;
+    DB_TXN_STAT* ptxnstat = NULL;
+    int64 nBytes = 0;
+    if (dbenv.log_stat(&plogstat, 0) == 0 && dbenv.txn_stat(&ptxnstat, 0) == 0)
+        nBytes = (int64)(plogstat->st_cur_file - ptxnstat->st_last_ckp.file) * plogstat->st_lg_size
+                 + plogstat->st_cur_offset - ptxnstat->st_last_ckp.offset;
+    free(plogstat);
+    free(ptxnstat);
+    return nBytes;
+}
+
+static void DBArchiveLogs()
+{
+    // Log files that hold no transaction from after the last checkpoint
+    // can go, they're only needed for catastrophic recovery
+    char** listp = NULL;
+    if (dbenv.log_archive(&listp, DB_ARCH_ABS) == 0 && listp)
+    {
+        for (char** ppsz = listp; *ppsz; ppsz++)
+        {
+            if (strDBLogArchiveDir.empty())
+            {
+                remove(*ppsz);
+            }
+            else
+            {
+                string strName = *ppsz;
+                strName = strName.substr(strName.find_last_of("\\/") + 1);
+                _mkdir(strDBLogArchiveDir.c_str());
+                if (rename(*ppsz, (strDBLogArchiveDir + "\\" + strName).c_str()) != 0)
+                    printf("DBArchiveLogs() : moving %s failed\n", *ppsz);
+            }
+        }
+        free(listp);
+    }
 
+    // What's left
+    nDBLogFiles = 0;
+    nDBLogBytes = 0;
+    listp = NULL;
+    if (dbenv.log_archive(&listp, DB_ARCH_ABS | DB_ARCH_LOG) == 0 && listp)
+    {
+        for (char** ppsz = listp; *ppsz; ppsz++)
+        {
+            FILE* file = fopen(*ppsz, "rb");
+            if (!file)
+                continue;
+            fseek(file, 0, SEEK_END);
+            nDBLogBytes += ftell(file);
+            fclose(file);
+            nDBLogFiles++;
+        }
+        free(listp);
+    }
+}
+
+void PrintDBStats()
+{
+    // Called with cs_dbCheckpoint held, so the environment stays open
+    bool fInit;
     CRITICAL_BLOCK(cs_db)
-        --mapFileUseCount[strFile];
+        fInit = fDbEnvInit;
+    if (fInit)
+    {
+        DB_MPOOL_STAT* pmpstat = NULL;
+        if (dbenv.memp_stat(&pmpstat, NULL, 0) == 0 && pmpstat)
+        {
+            int64 nRequests = (int64)pmpstat->st_cache_hit + pmpstat->st_cache_miss;
+            printf("dbstats mpool: cache %I64dMB in %u, %u pages %u dirty, hit %.1f%% of %I64d, in %u out %u, evict clean %u dirty %u\n",
+                   ((int64)pmpstat->st_gbytes << 10) + (pmpstat->st_bytes >> 20), pmpstat->st_ncache,
+                   pmpstat->st_pages, pmpstat->st_page_dirty,
+                   nRequests ? 100.0 * pmpstat->st_cache_hit / nRequests : 100.0, nRequests,
+                   pmpstat->st_page_in, pmpstat->st_page_out, pmpstat->st_ro_evict, pmpstat->st_rw_evict);
+            free(pmpstat);
+        }
+        DB_LOCK_STAT* plockstat = NULL;
+        if (dbenv.lock_stat(&plockstat, 0) == 0 && plockstat)
+        {
+            printf("dbstats locks: %u now %u peak of %u, objects %u now %u peak of %u, %u requests %u waits %u deadlocks\n",
+                   plockstat->st_nlocks, plockstat->st_maxnlocks, plockstat->st_maxlocks,
+                   plockstat->st_nobjects, plockstat->st_maxnobjects, plockstat->st_maxobjects,
+                   plockstat->st_nrequests, plockstat->st_lock_wait, plockstat->st_ndeadlocks);
+            free(plockstat);
+        }
+        DB_LOG_STAT* plogstat = NULL;
+        if (dbenv.log_stat(&plogstat, 0) == 0 && plogstat)
+        {
+            printf("dbstats log: %I64d bytes written, %I64d since checkpoint, %u writes %u syncs, file %u\n",
+                   ((int64)plogstat->st_w_mbytes << 20) + plogstat->st_w_bytes,
+                   ((int64)plogstat->st_wc_mbytes << 20) + plogstat->st_wc_bytes,
+                   plogstat->st_wcount, plogstat->st_scount, plogstat->st_cur_file);
+            free(plogstat);
+        }
+    }
+    printf("dbstats checkpoints: %I64d, avg %I64dus max %I64dus, %I64d log files %I64d bytes\n",
+           nDBCheckpoints, nDBCheckpoints ? nDBCheckpointMicros / nDBCheckpoints : 0, nDBCheckpointMicrosMax, nDBLogFiles, nDBLogBytes);
 
-    RandAddSeed();
+    static const char* pszOp[DBOP_MAX] = { "read", "write", "erase", "exists", "cursor", "batch" };
+    CRITICAL_BLOCK(cs_dbStats)
+    {
+        foreach(const PAIRTYPE(string, CDBFileStats)& item, mapDBFileStats)
+        {
+            string str;
+            for (int nOp = 0; nOp < DBOP_MAX; nOp++)
+                if (item.second.nCount[nOp])
+                    str += strprintf(" %s %I64d avg %I64dus max %I64dus,", pszOp[nOp], item.second.nCount[nOp],
+                                     item.second.nMicros[nOp] / item.second.nCount[nOp], item.second.nMicrosMax[nOp]);
+            printf("dbstats %s:%s\n", item.first.c_str(), str.c_str());
+        }
+    }
+}
+
+void ThreadDBCheckpoint(void* parg)
+{
+    int64 nLastStats = GetTime();
+    loop
+    {
+        Sleep(1000);
+        if (fShutdown)
+            return;
+
+        CRITICAL_BLOCK(cs_dbCheckpoint)
+        {
+            bool fInit;
+            CRITICAL_BLOCK(cs_db)
+                fInit = fDbEnvInit;
+
+            // DBFlush can't close the environment while we're in here
+            int64 nLogBytes = (fInit ? GetLogBytesSinceCheckpoint() : 0);
+            if (fInit && (GetTime() - nLastCheckpoint >= nDBCheckpointInterval || nLogBytes >= nDBCheckpointLogSize))
+            {
+                DBCheckpoint();
+                DBArchiveLogs();
+                printf("ThreadDBCheckpoint() : checkpoint %I64dus after %I64d bytes of log, %I64d log files %I64d bytes\n",
+                       nDBCheckpointMicrosLast, nLogBytes, nDBLogFiles, nDBLogBytes);
+            }
+
+            if (nDBStatsInterval > 0 && GetTime() - nLastStats >= nDBStatsInterval)
+            {
+                nLastStats = GetTime();
+                PrintDBStats();
+            }
+        }
+    }
 }
 
 void DBFlush(bool fShutdown)
@@ -134,9 +1266,10 @@ void DBFlush(bool fShutdown)
     // Flush log data to the actual data file
     //  on all files that are not in use
     printf("DBFlush(%s)\n", fShutdown ? "true" : "false");
+    CRITICAL_BLOCK(cs_dbCheckpoint)
     CRITICAL_BLOCK(cs_db)
     {
-        dbenv.txn_checkpoint(0, 0, 0);
+        DBCheckpoint();
         map<string, int>::iterator mi = mapFileUseCount.begin();
         while (mi != mapFileUseCount.end())
         {
@@ -152,6 +1285,9 @@ void DBFlush(bool fShutdown)
         }
         if (fShutdown)
         {
+            PrintDBStats();
+            foreach(const PAIRTYPE(string, CLogFile*)& item, mapLogFile)
+                item.second->Close();
             char** listp;
             if (mapFileUseCount.empty())
                 dbenv.log_archive(&listp, DB_ARCH_REMOVE);
@@ -187,6 +1323,15 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
 {
     assert(!fClient);
 
+    // Add to owner index
+    foreach(const CTxOut& txout, tx.vout)
+    {
+        uint160 hash160;
+        if (ExtractOwnerHash160(txout.scriptPubKey, hash160))
+            if (!AddOwnerTx(hash160, pos, nHeight))
+                return false;
+    }
+
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
@@ -201,19 +1346,87 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     return Erase(make_pair(string("tx"), hash));
 }
 
+bool CTxDB::EraseTxIndex(uint256 hash)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("tx"), hash));
+}
+
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
     return Exists(make_pair(string("tx"), hash));
 }
 
-bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
+bool CTxDB::AddOwnerTx(uint160 hash160, const CDiskTxPos& pos, int nHeight)
+{
+    assert(!fClient);
+    return Write(make_pair(string("owner"), make_pair(hash160, pos)), nHeight);
+}
+
+bool CTxDB::EraseOwnerTx(uint160 hash160, const CDiskTxPos& pos)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("owner"), make_pair(hash160, pos)));
+}
+
+bool CTxDB::EraseOwnerIndex()
+{
+    assert(!fClient);
+
+    // Collect the keys first, the cursor isn't part of the batch
+    vector<pair<uint160, CDiskTxPos> > vKeys;
+    CDBCursor* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << string("owner") << uint160(0) << CDiskTxPos(0, 0, 0);
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "owner")
+            break;
+        uint160 hash160;
+        CDiskTxPos pos;
+        ssKey >> hash160 >> pos;
+        vKeys.push_back(make_pair(hash160, pos));
+    }
+    pcursor->close();
+
+    for (int i = 0; i < vKeys.size(); i += 10000)
+    {
+        if (!BatchBegin())
+            return false;
+        for (int j = i; j < vKeys.size() && j < i + 10000; j++)
+            EraseOwnerTx(vKeys[j].first, vKeys[j].second);
+        if (!BatchCommit())
+            return false;
+    }
+    printf("EraseOwnerIndex() : erased %d entries\n", vKeys.size());
+    return true;
+}
+
+bool CTxDB::ReadOwnerTxPos(uint160 hash160, int nMinHeight, vector<pair<int, CDiskTxPos> >& vPosRet)
 {
     assert(!fClient);
-    vtx.clear();
+    vPosRet.clear();
 
     // Get cursor
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         return false;
 
@@ -230,7 +1443,10 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
         if (ret == DB_NOTFOUND)
             break;
         else if (ret != 0)
+        {
+            pcursor->close();
             return false;
+        }
 
         // Unserialize
         string strType;
@@ -240,16 +1456,31 @@ bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>&
         int nItemHeight;
         ssValue >> nItemHeight;
 
-        // Read transaction
         if (strType != "owner" || hashItem != hash160)
             break;
         if (nItemHeight >= nMinHeight)
-        {
-            vtx.resize(vtx.size()+1);
-            if (!vtx.back().ReadFromDisk(pos))
-                return false;
-        }
+            vPosRet.push_back(make_pair(nItemHeight, pos));
     }
+    pcursor->close();
+
+    // Keys are in byte order, callers want them in chain order
+    sort(vPosRet.begin(), vPosRet.end());
+    return true;
+}
+
+bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
+{
+    vtx.clear();
+
+    vector<pair<int, CDiskTxPos> > vPos;
+    if (!ReadOwnerTxPos(hash160, nMinHeight, vPos))
+        return false;
+
+    // Read transactions
+    vtx.resize(vPos.size());
+    for (int i = 0; i < vPos.size(); i++)
+        if (!vtx[i].ReadFromDisk(vPos[i].second))
+            return false;
     return true;
 }
 
@@ -279,16 +1510,41 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+// Counts block index erases, under cs_main, so a snapshot written in the
+// background knows whether the log moved on meanwhile
+static unsigned int nBlockIndexLogWrites = 0;
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    // The next load from the snapshot finds it in the block files
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
 bool CTxDB::EraseBlockIndex(uint256 hash)
 {
+    // Log it for the next load from the snapshot
+    nBlockIndexLogWrites++;
+    if (!Write(make_pair(string("blockindexlog"), hash), true))
+        return false;
     return Erase(make_pair(string("blockindex"), hash));
 }
 
+bool CTxDB::ReadBlockUndo(uint256 hash, CBlockUndo& undo)
+{
+    undo.SetNull();
+    return Read(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hash, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::EraseBlockUndo(uint256 hash)
+{
+    return Erase(make_pair(string("blockundo"), hash));
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -305,7 +1561,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -319,10 +1575,103 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+static CBlockIndex* LoadDiskBlockIndex(uint256 hash, const CDiskBlockIndex& diskindex)
+{
+    // Construct block index object
+    CBlockIndex* pindexNew = InsertBlockIndex(hash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+    pindexNew->nTx            = diskindex.nTx;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
+        pindexGenesisBlock = pindexNew;
+    return pindexNew;
+}
+
+static void ClearBlockIndex()
+{
+    foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        delete item.second;
+    mapBlockIndex.clear();
+    pindexGenesisBlock = NULL;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
+    int nOldRecords = 0;
+    if (!LoadBlockIndexSnapshot())
+    {
+        ClearBlockIndex();
+        if (!LoadBlockIndexScan(nOldRecords))
+            return false;
+    }
+
+    // Old records didn't have the tx count, get it from the block files
+    if (nOldRecords > 0)
+        foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            if (item.second->nTx == 0)
+                item.second->nTx = ReadBlockTxCount(item.second->nFile, item.second->nBlockPos);
+
+    // Build skip pointers and cached values, parents first
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    foreach(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        item.second->BuildSkip();
+        item.second->CacheChainValues();
+    }
+
+    if (!ReadHashBestChain(hashBestChain))
+    {
+        if (pindexGenesisBlock == NULL)
+            return true;
+        return error("CTxDB::LoadBlockIndex() : hashBestChain not found\n");
+    }
+
+    if (!mapBlockIndex.count(hashBestChain))
+        return error("CTxDB::LoadBlockIndex() : blockindex for hashBestChain not found\n");
+    pindexBest = mapBlockIndex[hashBestChain];
+    nBestHeight = pindexBest->nHeight;
+    SetMainChain(pindexBest);
+    printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,14).c_str(), nBestHeight);
+
+    // Forward links aren't stored, the best chain gives them
+    for (int i = 1; i < vMainChain.size(); i++)
+        vMainChain[i-1]->pnext = vMainChain[i];
+
+    // Rewrite records from before DISKINDEX_VERSION in one go
+    if (nOldRecords > 0)
+    {
+        printf("LoadBlockIndex() : upgrading %d block index records to version %d\n", nOldRecords, DISKINDEX_VERSION);
+        if (!BatchBegin())
+            return error("CTxDB::LoadBlockIndex() : BatchBegin failed");
+        foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            WriteBlockIndex(CDiskBlockIndex(item.second));
+        if (!BatchCommit())
+            return error("CTxDB::LoadBlockIndex() : upgrade commit failed");
+        WriteBlockIndexSnapshot();
+    }
+
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexScan(int& nOldRecordsRet)
+{
+    nOldRecordsRet = 0;
+
     // Get cursor
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         return false;
 
@@ -348,46 +1697,392 @@ bool CTxDB::LoadBlockIndex()
         {
             CDiskBlockIndex diskindex;
             ssValue >> diskindex;
-
-            // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-            // Watch for genesis block and best block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                pindexGenesisBlock = pindexNew;
+            LoadDiskBlockIndex(diskindex.GetBlockHash(), diskindex);
+            if (diskindex.nDiskVersion < DISKINDEX_VERSION)
+                nOldRecordsRet++;
         }
         else
         {
             break;
         }
     }
+    pcursor->close();
+    printf("LoadBlockIndexScan() : loaded %d block index entries\n", mapBlockIndex.size());
+    return true;
+}
 
-    if (!ReadHashBestChain(hashBestChain))
+
+
+
+//
+// Block index snapshot
+//
+// A flat copy of the block index in blkindex.snp, entries in height
+// order with the prev link as a position in the file.  It loads
+// with one read and no hashing.  Blocks are appended to the block files
+// in the order they're indexed, so the ones indexed since the snapshot was
+// taken are found after the last block it has.  Erased records are listed
+// under "blockindexlog" and read on top of that.  The snapshot is only
+// used if its id matches "blockindexsnapshot" in the database, otherwise
+// we fall back to scanning the records.
+//
+
+static string GetBlockIndexSnapshotFile()
+{
+    return strprintf("%s\\blkindex.snp", GetAppDir().c_str());
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    uint64 nSnapshotId = 0;
+    if (!Read(string("blockindexsnapshot"), nSnapshotId))
+        return false;
+
+    // One sequential read of the whole file
+    FILE* file = fopen(GetBlockIndexSnapshotFile().c_str(), "rb");
+    if (!file)
+        return false;
+    int nFileSize = GetFilesize(file);
+    if (nFileSize <= 0)
     {
-        if (pindexGenesisBlock == NULL)
-            return true;
-        return error("CTxDB::LoadBlockIndex() : hashBestChain not found\n");
+        fclose(file);
+        return false;
     }
+    vector<char> vch(nFileSize);
+    int nRead = fread(&vch[0], 1, nFileSize, file);
+    fclose(file);
+    if (nRead != nFileSize)
+        return error("LoadBlockIndexSnapshot() : fread failed");
 
-    if (!mapBlockIndex.count(hashBestChain))
-        return error("CTxDB::LoadBlockIndex() : blockindex for hashBestChain not found\n");
-    pindexBest = mapBlockIndex[hashBestChain];
-    nBestHeight = pindexBest->nHeight;
-    printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,14).c_str(), nBestHeight);
+    try
+    {
+        CMemoryStream ss(&vch[0], &vch[0] + vch.size(), SER_DISK);
+        int nVersion = 0;
+        uint64 nId = 0;
+        unsigned int nCount = 0;
+        ss >> nVersion >> nId >> nCount;
+        if (nVersion != DISKINDEX_VERSION || nId != nSnapshotId)
+        {
+            printf("LoadBlockIndexSnapshot() : snapshot is stale\n");
+            return false;
+        }
+
+        vector<CBlockIndex*> vIndex;
+        vIndex.reserve(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            uint256 hash;
+            int nPrev;
+            ss >> hash >> nPrev;
+            if (nPrev >= (int)i)
+                return error("LoadBlockIndexSnapshot() : prev out of order");
+
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
+            pindexNew->pprev = (nPrev >= 0 ? vIndex[nPrev] : NULL);
+            ss >> pindexNew->nFile >> pindexNew->nBlockPos >> pindexNew->nHeight;
+            ss >> pindexNew->nVersion >> pindexNew->hashMerkleRoot >> pindexNew->nTime >> pindexNew->nBits >> pindexNew->nNonce;
+            ss >> pindexNew->nTx;
+            vIndex.push_back(pindexNew);
+        }
+    }
+    catch (std::exception& e)
+    {
+        return error("LoadBlockIndexSnapshot() : %s", e.what());
+    }
+    int nSnapshotSize = mapBlockIndex.size();
+
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashGenesisBlock);
+    if (mi != mapBlockIndex.end())
+        pindexGenesisBlock = (*mi).second;
+
+    // Add the blocks indexed since
+    CBlockIndex* pindexLast = NULL;
+    foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->nFile != -1 && (!pindexLast || pindex->nFile > pindexLast->nFile || (pindex->nFile == pindexLast->nFile && pindex->nBlockPos > pindexLast->nBlockPos)))
+            pindexLast = pindex;
+    }
+    int nAppended = 0;
+    if (pindexLast && !LoadAppendedBlockIndex(pindexLast->nFile, pindexLast->nBlockPos, nAppended))
+        return false;
+
+    // Apply the records erased since
+    CDBCursor* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    int nChanged = 0;
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("blockindexlog"), uint256(0));
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+
+        string strType;
+        uint256 hash;
+        ssKey >> strType;
+        if (strType != "blockindexlog")
+            break;
+        ssKey >> hash;
+        nChanged++;
+
+        CDiskBlockIndex diskindex;
+        if (Read(make_pair(string("blockindex"), hash), diskindex))
+        {
+            LoadDiskBlockIndex(hash, diskindex);
+        }
+        else
+        {
+            // Erased since
+            mi = mapBlockIndex.find(hash);
+            if (mi != mapBlockIndex.end())
+            {
+                if (pindexGenesisBlock == (*mi).second)
+                    pindexGenesisBlock = NULL;
+                delete (*mi).second;
+                mapBlockIndex.erase(mi);
+            }
+        }
+    }
+    pcursor->close();
+
+    printf("LoadBlockIndexSnapshot() : loaded %d block index entries, %d added and %d erased since\n", nSnapshotSize, nAppended, nChanged);
+    return true;
+}
+
+bool CTxDB::LoadAppendedBlockIndex(unsigned int nFile, unsigned int nBlockPos, int& nAppendedRet)
+{
+    // Walk the records after the given block, the message start, the size
+    // and the block, and load the ones the index has at that position.
+    // Records that were never indexed or were erased are stepped over.
+    nAppendedRet = 0;
+    try
+    {
+        unsigned int nPos = 0;
+        {
+            CAutoFile filein = OpenBlockFile(nFile, nBlockPos - sizeof(unsigned int), "rb");
+            if (!filein)
+                return error("LoadAppendedBlockIndex() : can't open blk%04d.dat", nFile);
+            unsigned int nSize = 0;
+            filein >> nSize;
+            nPos = nBlockPos + nSize;
+        }
+
+        loop
+        {
+            CAutoFile filein = OpenBlockFile(nFile, 0, "rb");
+            if (!filein)
+                break;
+            unsigned int nDataEnd = GetBlockFileDataSize(nFile, GetFilesize(filein));
+            unsigned int nHeaderSize = sizeof(pchMessageStart) + sizeof(unsigned int);
+            while (nPos + nHeaderSize <= nDataEnd)
+            {
+                // The preallocated tail is zeros and ends the file
+                char pchMessageStartRead[sizeof(pchMessageStart)];
+                unsigned int nSize = 0;
+                if (fseek(filein, nPos, SEEK_SET) != 0)
+                    return error("LoadAppendedBlockIndex() : fseek failed");
+                filein >> FLATDATA(pchMessageStartRead) >> nSize;
+                if (memcmp(pchMessageStartRead, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > nDataEnd - nPos - nHeaderSize)
+                    break;
+
+                CBlock block;
+                filein.nType |= SER_BLOCKHEADERONLY;
+                filein >> block;
+                uint256 hash = block.GetHash();
+                CDiskBlockIndex diskindex;
+                if (Read(make_pair(string("blockindex"), hash), diskindex) && diskindex.nFile == nFile && diskindex.nBlockPos == nPos + nHeaderSize)
+                {
+                    LoadDiskBlockIndex(hash, diskindex);
+                    nAppendedRet++;
+                }
+                nPos += nHeaderSize + nSize;
+            }
+            nFile++;
+            nPos = 0;
+        }
+    }
+    catch (std::exception& e)
+    {
+        return error("LoadAppendedBlockIndex() : %s", e.what());
+    }
+    return true;
+}
+
+bool CTxDB::CaptureBlockIndexSnapshot(CBlockIndexSnapshot& snapshot)
+{
+    // Called with cs_main held, everything else works from the copy
+    if (!pstore)
+        return false;
+
+    // Parents before children
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    map<CBlockIndex*, int> mapPos;
+    for (int i = 0; i < vSortedByHeight.size(); i++)
+        mapPos[vSortedByHeight[i].second] = i;
+
+    snapshot.nId = GetRand(_UI64_MAX);
+    snapshot.nCount = vSortedByHeight.size();
+    snapshot.nLogWrites = nBlockIndexLogWrites;
+    CDataStream& ss = snapshot.ss;
+    ss.reserve(vSortedByHeight.size() * 120);
+    ss << DISKINDEX_VERSION << snapshot.nId << (unsigned int)vSortedByHeight.size();
+    for (int i = 0; i < vSortedByHeight.size(); i++)
+    {
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        int nPrev = (pindex->pprev ? mapPos[pindex->pprev] : -1);
+        ss << pindex->GetBlockHash() << nPrev;
+        ss << pindex->nFile << pindex->nBlockPos << pindex->nHeight;
+        ss << pindex->nVersion << pindex->hashMerkleRoot << pindex->nTime << pindex->nBits << pindex->nNonce;
+        ss << pindex->nTx;
+    }
+
+    // The log records it covers
+    snapshot.vLog.clear();
+    CDBCursor* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    unsigned int fFlags = DB_SET_RANGE;
+    loop
+    {
+        CDataStream ssKey;
+        if (fFlags == DB_SET_RANGE)
+            ssKey << make_pair(string("blockindexlog"), uint256(0));
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret != 0)
+            break;
+        string strType;
+        ssKey >> strType;
+        if (strType != "blockindexlog")
+            break;
+        uint256 hash;
+        ssKey >> hash;
+        snapshot.vLog.push_back(hash);
+    }
+    pcursor->close();
+    return true;
+}
+
+static CCriticalSection cs_BlockIndexSnapshotFile;
+static uint64 nBlockIndexSnapshotFileId = 0;
+
+static bool WriteBlockIndexSnapshotFile(const CBlockIndexSnapshot& snapshot)
+{
+    // Write to a new file, get it to disk and swap it in
+    CRITICAL_BLOCK(cs_BlockIndexSnapshotFile)
+    {
+        string strFile = GetBlockIndexSnapshotFile();
+        string strFileNew = strFile + ".new";
+        FILE* file = fopen(strFileNew.c_str(), "wb");
+        if (!file)
+            return error("WriteBlockIndexSnapshotFile() : fopen %s failed", strFileNew.c_str());
+        bool fOk = (fwrite(&snapshot.ss[0], 1, snapshot.ss.size(), file) == snapshot.ss.size());
+        fOk = fOk && (fflush(file) == 0) && (_commit(_fileno(file)) == 0);
+        fclose(file);
+        if (!fOk)
+            return error("WriteBlockIndexSnapshotFile() : write failed");
+        remove(strFile.c_str());
+        if (rename(strFileNew.c_str(), strFile.c_str()) != 0)
+            return error("WriteBlockIndexSnapshotFile() : rename failed");
+        nBlockIndexSnapshotFileId = snapshot.nId;
+    }
+    return true;
+}
+
+bool CTxDB::CommitBlockIndexSnapshot(const CBlockIndexSnapshot& snapshot)
+{
+    // Called with cs_main held, after the file is on disk
+    CRITICAL_BLOCK(cs_BlockIndexSnapshotFile)
+        if (nBlockIndexSnapshotFileId != snapshot.nId)
+            return error("CommitBlockIndexSnapshot() : snapshot file was replaced");
+
+    // Log records written since the copy was taken may be newer than it, so
+    // then the log is left for the next snapshot.  Applying it twice is harmless.
+    bool fClearLog = (nBlockIndexLogWrites == snapshot.nLogWrites);
+    TxnBegin();
+    bool fOk = Write(string("blockindexsnapshot"), snapshot.nId);
+    if (fClearLog)
+        foreach(const uint256& hash, snapshot.vLog)
+            fOk = fOk && Erase(make_pair(string("blockindexlog"), hash));
+    if (!fOk)
+    {
+        TxnAbort();
+        return error("CommitBlockIndexSnapshot() : database write failed");
+    }
+    TxnCommit();
+    return true;
+}
 
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    // Called with cs_main held, at startup and shutdown
+    int64 nStart = GetTimeMicros();
+    CBlockIndexSnapshot snapshot;
+    if (!CaptureBlockIndexSnapshot(snapshot) || !WriteBlockIndexSnapshotFile(snapshot) || !CommitBlockIndexSnapshot(snapshot))
+        return false;
+    printf("WriteBlockIndexSnapshot() : %d entries, %d log records cleared, %I64dus\n", snapshot.nCount, snapshot.vLog.size(), GetTimeMicros() - nStart);
     return true;
 }
 
+void ThreadBlockIndexSnapshot(void* parg)
+{
+    // Runs in thread slot 4 so StopNode waits for it
+    auto_ptr<CBlockIndexSnapshot> psnapshot((CBlockIndexSnapshot*)parg);
+    int64 nStart = GetTimeMicros();
+    if (WriteBlockIndexSnapshotFile(*psnapshot))
+    {
+        CRITICAL_BLOCK(cs_main)
+        {
+            // Shutdown writes its own and closes the database
+            if (!fShutdown)
+            {
+                CTxDB txdb;
+                if (txdb.CommitBlockIndexSnapshot(*psnapshot))
+                    printf("ThreadBlockIndexSnapshot() : %d entries, %I64dus\n", psnapshot->nCount, GetTimeMicros() - nStart);
+            }
+        }
+    }
+    vfThreadRunning[4] = false;
+}
+
+void StartBlockIndexSnapshot(CTxDB& txdb)
+{
+    // Called with cs_main held.  Only the copy is taken here, the file is
+    // written and synced on another thread.
+    if (vfThreadRunning[4])
+        return;
+    CBlockIndexSnapshot* psnapshot = new CBlockIndexSnapshot();
+    if (!txdb.CaptureBlockIndexSnapshot(*psnapshot))
+    {
+        delete psnapshot;
+        return;
+    }
+    vfThreadRunning[4] = true;
+    if (_beginthread(ThreadBlockIndexSnapshot, 0, psnapshot) == -1)
+    {
+        printf("Error: _beginthread(ThreadBlockIndexSnapshot) failed\n");
+        vfThreadRunning[4] = false;
+        delete psnapshot;
+    }
+}
+
 
 
 
@@ -423,7 +2118,7 @@ bool CAddrDB::LoadAddresses()
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
             return false;
 
@@ -501,7 +2196,7 @@ bool CWalletDB::LoadWallet(vector<unsigned char>& vchDefaultKeyRet)
     CRITICAL_BLOCK(cs_mapWallet)
     {
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
             return false;
 
@@ -602,3 +2297,104 @@ bool LoadWallet()
 
     return true;
 }
+
+
+
+
+
+
+
+
+
+#ifdef TESTDBSTORE
+//
+// Replays the tx index traffic of connecting the main chain against each
+// store, then reads every entry back.  Run with /benchdbstore[=nBlocks].
+//
+class CBenchDB : public CDB
+{
+public:
+    CBenchDB(const char* pszFile, int nStore) : CDB(pszFile, "cr", false, nStore) { }
+
+    bool ConnectBenchBlock(const CBlock& block)
+    {
+        BatchBegin();
+        foreach(const CTransaction& tx, block.vtx)
+        {
+            if (!tx.IsCoinBase())
+            {
+                foreach(const CTxIn& txin, tx.vin)
+                {
+                    CTxIndex txindex;
+                    if (!Read(make_pair(string("tx"), txin.prevout.hash), txindex))
+                    {
+                        BatchAbort();
+                        return false;
+                    }
+                    if (txin.prevout.n < txindex.vSpent.size())
+                        txindex.vSpent[txin.prevout.n] = CDiskTxPos(1, 1, 1);
+                    Write(make_pair(string("tx"), txin.prevout.hash), txindex);
+                }
+            }
+            Write(make_pair(string("tx"), tx.GetHash()), CTxIndex(CDiskTxPos(1, 1, 1), tx.vout.size()));
+        }
+        return BatchCommit();
+    }
+
+    int ReadBench(const vector<uint256>& vHash)
+    {
+        int nFound = 0;
+        foreach(const uint256& hash, vHash)
+        {
+            CTxIndex txindex;
+            if (Read(make_pair(string("tx"), hash), txindex))
+                nFound++;
+        }
+        return nFound;
+    }
+};
+
+void BenchmarkDBStore(int nBlocks)
+{
+    // Blocks are read up front so only the stores are timed
+    vector<CBlock> vBlock;
+    vector<uint256> vHash;
+    for (int i = 0; i < vMainChain.size() && i < nBlocks; i++)
+    {
+        vBlock.resize(vBlock.size()+1);
+        if (!vBlock.back().ReadFromDisk(vMainChain[i], true))
+        {
+            printf("BenchmarkDBStore() : ReadFromDisk failed at height %d\n", i);
+            return;
+        }
+        foreach(const CTransaction& tx, vBlock.back().vtx)
+            vHash.push_back(tx.GetHash());
+    }
+    random_shuffle(vHash.begin(), vHash.end());
+
+    const char* pszStore[] = { "bdb", "log" };
+    const char* pszFile[] = { "benchbdb.dat", "benchlog.dat" };
+    CRITICAL_BLOCK(cs_db)
+        InitDbEnv();
+    dbenv.dbremove(NULL, pszFile[DBSTORE_BDB], NULL, DB_AUTO_COMMIT);
+    remove((GetAppDir() + "\\benchlog.logdb").c_str());
+
+    for (int nStore = DBSTORE_BDB; nStore <= DBSTORE_LOG; nStore++)
+    {
+        CBenchDB db(pszFile[nStore], nStore);
+        int64 nStart = GetTimeMicros();
+        int nConnected = 0;
+        foreach(const CBlock& block, vBlock)
+            if (db.ConnectBenchBlock(block))
+                nConnected++;
+        int64 nWriteTime = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        int nFound = db.ReadBench(vHash);
+        int64 nReadTime = GetTimeMicros() - nStart;
+
+        printf("BenchmarkDBStore() : %s  %d/%d blocks %I64dms  %d/%d reads %I64dms\n", pszStore[nStore],
+               nConnected, vBlock.size(), nWriteTime / 1000, nFound, vHash.size(), nReadTime / 1000);
+    }
+}
+#endif
@@ -5,6 +5,7 @@
 #include <db_cxx.h>
 class CTransaction;
 class CTxIndex;
+class CBlockUndo;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class COutPoint;
@@ -12,6 +13,7 @@ class CUser;
 class CReview;
 class CAddress;
 class CWalletTx;
+class CTxDB;
 
 extern map<string, string> mapAddressBook;
 extern bool fClient;
@@ -19,6 +21,145 @@ extern bool fClient;
 
 extern DbEnv dbenv;
 extern void DBFlush(bool fShutdown);
+extern int64 nBatchCommits;
+extern int64 nBatchCommitMicros;
+extern int64 nBatchCommitMicrosMax;
+extern int nTxDBStore;
+extern int nLogDBSync;
+extern int nDBCheckpointInterval;
+extern int nDBCheckpointLogSize;
+extern string strDBLogArchiveDir;
+extern int64 nDBCheckpoints;
+extern int64 nDBCheckpointMicros;
+extern int64 nDBCheckpointMicrosMax;
+extern int64 nDBCheckpointMicrosLast;
+extern int64 nDBLogFiles;
+extern int64 nDBLogBytes;
+extern int64 nDBCacheSize;
+extern int nDBMaxLocks;
+extern int nDBLogFileSize;
+extern int nDBStatsInterval;
+extern void PrintDBStats();
+extern void StartBlockIndexSnapshot(CTxDB& txdb);
+
+enum
+{
+    DBOP_READ,
+    DBOP_WRITE,
+    DBOP_ERASE,
+    DBOP_EXISTS,
+    DBOP_CURSOR,
+    DBOP_BATCH,
+    DBOP_MAX,
+};
+
+// Operation counts and latencies of one database file
+class CDBFileStats
+{
+public:
+    int64 nCount[DBOP_MAX];
+    int64 nMicros[DBOP_MAX];
+    int64 nMicrosMax[DBOP_MAX];
+
+    CDBFileStats()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+};
+#ifdef TESTDBSTORE
+extern void BenchmarkDBStore(int nBlocks);
+#endif
+
+enum
+{
+    DBSTORE_BDB,
+    DBSTORE_LOG,
+};
+
+
+
+
+//
+// Write batch for CDB.  Collects the writes and erases of one unit of work,
+// like connecting a block, in memory ordered by serialized key so they can
+// be applied to the btree in key order in one transaction.
+//
+class CDBBatch
+{
+public:
+    // serialized key -> (fErase, serialized value)
+    typedef map<vector<unsigned char>, pair<bool, vector<unsigned char> > > map_type;
+    map_type mapWrite;
+
+    void Write(const CDataStream& ssKey, const CDataStream& ssValue)
+    {
+        pair<bool, vector<unsigned char> >& item = mapWrite[vector<unsigned char>(ssKey.begin(), ssKey.end())];
+        item.first = false;
+        item.second.assign(ssValue.begin(), ssValue.end());
+    }
+
+    void Erase(const CDataStream& ssKey)
+    {
+        pair<bool, vector<unsigned char> >& item = mapWrite[vector<unsigned char>(ssKey.begin(), ssKey.end())];
+        item.first = true;
+        item.second.clear();
+    }
+
+    void Merge(const CDBBatch& batch)
+    {
+        for (map_type::const_iterator mi = batch.mapWrite.begin(); mi != batch.mapWrite.end(); ++mi)
+            mapWrite[(*mi).first] = (*mi).second;
+    }
+
+    // Returns -1 if the batch doesn't touch the key, 0 if it erases it,
+    // or 1 with the pending value in ssValue
+    int Find(const CDataStream& ssKey, CDataStream& ssValue) const
+    {
+        map_type::const_iterator mi = mapWrite.find(vector<unsigned char>(ssKey.begin(), ssKey.end()));
+        if (mi == mapWrite.end())
+            return -1;
+        if ((*mi).second.first)
+            return 0;
+        ssValue.clear();
+        if (!(*mi).second.second.empty())
+            ssValue.write((char*)&(*mi).second.second[0], (*mi).second.second.size());
+        return 1;
+    }
+};
+
+
+
+
+//
+// Storage under CDB.  Keys and values are serialized byte strings and the
+// return codes follow Berkeley DB: 0, DB_NOTFOUND or something else on error.
+// Cursors take DB_SET, DB_SET_RANGE and DB_NEXT.
+//
+class CDBCursor
+{
+public:
+    virtual ~CDBCursor() { }
+    virtual int Get(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags) = 0;
+    void close() { delete this; }
+};
+
+class CDBStore
+{
+public:
+    virtual ~CDBStore() { }
+    virtual int Get(const CDataStream& ssKey, CDataStream& ssValue) = 0;
+    virtual int Put(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite) = 0;
+    virtual int Del(const CDataStream& ssKey) = 0;
+    virtual int Exists(const CDataStream& ssKey) = 0;
+    virtual CDBCursor* GetCursor() = 0;
+
+    // All of the batch or none of it
+    virtual bool WriteBatch(const CDBBatch& batch) = 0;
+
+    virtual bool TxnBegin() = 0;
+    virtual bool TxnCommit() = 0;
+    virtual bool TxnAbort() = 0;
+};
 
 
 
@@ -26,11 +167,13 @@ extern void DBFlush(bool fShutdown);
 class CDB
 {
 protected:
-    Db* pdb;
+    CDBStore* pstore;
     string strFile;
-    vector<DbTxn*> vTxn;
+    CDBBatch* pbatch;
+    int nStore;
+    CDBFileStats stats;
 
-    explicit CDB(const char* pszFile, const char* pszMode="r+", bool fTxn=false);
+    explicit CDB(const char* pszFile, const char* pszMode="r+", bool fTxn=false, int nStore=DBSTORE_BDB);
     ~CDB() { Close(); }
 public:
     void Close();
@@ -39,196 +182,160 @@ private:
     void operator=(const CDB&);
 
 protected:
+    // Timing is only taken with /dbstats, counts are kept per handle and
+    // added to the per-file totals when it closes
+    int64 BeginOp() { return (nDBStatsInterval > 0 ? GetTimeMicros() : 0); }
+    void RecordOp(int nOp, int64 nStart);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
+        int64 nStart = BeginOp();
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
-
-        // Read
-        Dbt datValue;
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
-        if (datValue.get_data() == NULL)
+
+        // Pending writes in the batch take precedence
+        CDataStream ssValue(SER_DISK);
+        int nFound = (pbatch ? pbatch->Find(ssKey, ssValue) : -1);
+        if (nFound == -1)
+            nFound = (pstore->Get(ssKey, ssValue) == 0 ? 1 : 0);
+        memset(&ssKey[0], 0, ssKey.size());
+        RecordOp(DBOP_READ, nStart);
+        if (nFound != 1)
             return false;
 
         // Unserialize value
-        CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK);
         ssValue >> value;
-
-        // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datValue.get_data());
-        return (ret == 0);
+        return true;
     }
 
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
+        int64 nStart = BeginOp();
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK);
         ssValue.reserve(10000);
         ssValue << value;
-        Dbt datValue(&ssValue[0], ssValue.size());
 
-        // Write
-        int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        // Defer to the batch if there is one
+        int ret = 0;
+        if (pbatch)
+            pbatch->Write(ssKey, ssValue);
+        else
+            ret = pstore->Put(ssKey, ssValue, fOverwrite);
 
         // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
+        memset(&ssKey[0], 0, ssKey.size());
+        memset(&ssValue[0], 0, ssValue.size());
+        RecordOp(DBOP_WRITE, nStart);
         return (ret == 0);
     }
 
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
+        int64 nStart = BeginOp();
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
-        // Erase
-        int ret = pdb->del(GetTxn(), &datKey, 0);
+        // Defer to the batch if there is one
+        int ret = 0;
+        if (pbatch)
+            pbatch->Erase(ssKey);
+        else
+            ret = pstore->Del(ssKey);
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(&ssKey[0], 0, ssKey.size());
+        RecordOp(DBOP_ERASE, nStart);
         return (ret == 0 || ret == DB_NOTFOUND);
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
+        int64 nStart = BeginOp();
 
         // Key
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
-        // Exists
-        int ret = pdb->exists(GetTxn(), &datKey, 0);
+        // Pending writes in the batch take precedence
+        CDataStream ssValue(SER_DISK);
+        int nFound = (pbatch ? pbatch->Find(ssKey, ssValue) : -1);
+        if (nFound == -1)
+            nFound = (pstore->Exists(ssKey) == 0 ? 1 : 0);
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0);
+        memset(&ssKey[0], 0, ssKey.size());
+        RecordOp(DBOP_EXISTS, nStart);
+        return (nFound == 1);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
-        if (!pdb)
+        if (!pstore)
             return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
+        return pstore->GetCursor();
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
-    }
-
-    DbTxn* GetTxn()
-    {
-        if (!vTxn.empty())
-            return vTxn.back();
-        else
-            return NULL;
+        int64 nStart = BeginOp();
+        int ret = pcursor->Get(ssKey, ssValue, fFlags);
+        RecordOp(DBOP_CURSOR, nStart);
+        return ret;
     }
 
 public:
     bool TxnBegin()
     {
-        if (!pdb)
+        if (!pstore)
             return false;
-        DbTxn* ptxn = NULL;
-        int ret = dbenv.txn_begin(GetTxn(), &ptxn, 0);
-        if (!ptxn || ret != 0)
-            return false;
-        vTxn.push_back(ptxn);
-        return true;
+        return pstore->TxnBegin();
     }
 
     bool TxnCommit()
     {
-        if (!pdb)
+        if (!pstore)
             return false;
-        if (vTxn.empty())
-            return false;
-        int ret = vTxn.back()->commit(0);
-        vTxn.pop_back();
-        return (ret == 0);
+        return pstore->TxnCommit();
     }
 
     bool TxnAbort()
     {
-        if (!pdb)
+        if (!pstore)
             return false;
-        if (vTxn.empty())
-            return false;
-        int ret = vTxn.back()->abort();
-        vTxn.pop_back();
-        return (ret == 0);
+        return pstore->TxnAbort();
     }
 
+    // Cursor reads don't see writes pending in the batch
+    bool BatchBegin();
+    bool BatchCommit();
+    bool BatchAbort();
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -248,10 +355,29 @@ public:
 
 
 
+// Block index snapshot contents, copied under cs_main so the file can be
+// written without holding it
+class CBlockIndexSnapshot
+{
+public:
+    uint64 nId;
+    int nCount;
+    unsigned int nLogWrites;
+    CDataStream ss;
+    vector<uint256> vLog;
+
+    CBlockIndexSnapshot() : ss(SER_DISK)
+    {
+        nId = 0;
+        nCount = 0;
+        nLogWrites = 0;
+    }
+};
+
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+", bool fTxn=false) : CDB(!fClient ? "blkindex.dat" : NULL, pszMode, fTxn) { }
+    CTxDB(const char* pszMode="r+", bool fTxn=false) : CDB(!fClient ? "blkindex.dat" : NULL, pszMode, fTxn, nTxDBStore) { }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
@@ -260,7 +386,12 @@ public:
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
+    bool EraseTxIndex(uint256 hash);
     bool ContainsTx(uint256 hash);
+    bool AddOwnerTx(uint160 hash160, const CDiskTxPos& pos, int nHeight);
+    bool EraseOwnerTx(uint160 hash160, const CDiskTxPos& pos);
+    bool EraseOwnerIndex();
+    bool ReadOwnerTxPos(uint160 hash160, int nMinHeight, vector<pair<int, CDiskTxPos> >& vPosRet);
     bool ReadOwnerTxes(uint160 hash160, int nHeight, vector<CTransaction>& vtx);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
@@ -268,9 +399,19 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool EraseBlockIndex(uint256 hash);
+    bool ReadBlockUndo(uint256 hash, CBlockUndo& undo);
+    bool WriteBlockUndo(uint256 hash, const CBlockUndo& undo);
+    bool EraseBlockUndo(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
+    bool CaptureBlockIndexSnapshot(CBlockIndexSnapshot& snapshot);
+    bool CommitBlockIndexSnapshot(const CBlockIndexSnapshot& snapshot);
+protected:
+    bool LoadBlockIndexScan(int& nOldRecordsRet);
+    bool LoadBlockIndexSnapshot();
+    bool LoadAppendedBlockIndex(unsigned int nFile, unsigned int nBlockPos, int& nAppendedRet);
 };
 
 
@@ -12,6 +12,7 @@
 #endif
 #define _WIN32_WINNT 0x0400
 #define WIN32_LEAN_AND_MEAN 1
+#define FD_SETSIZE 1024 // winsock select over all peers
 #include <wx/wx.h>
 #include <wx/clipbrd.h>
 #include <wx/snglinst.h>
@@ -25,6 +26,7 @@
 #include <mswsock.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <io.h>
 #include <math.h>
 #include <limits.h>
@@ -49,6 +51,7 @@
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/tuple/tuple_io.hpp>
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
 #pragma hdrstop
 using namespace std;
 using namespace boost;
@@ -20,12 +20,41 @@ CCriticalSection cs_mapTransactions;
 unsigned int nTransactionsUpdated = 0;
 map<COutPoint, CInPoint> mapNextTx;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
 const uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+vector<CBlockIndex*> vMainChain;
+
+// Headers checked ahead of their blocks, with nFile -1.  Dropped together
+// once the block chain catches up with pindexBestHeader.
+CBlockIndexMap mapHeaderIndex;
+CBlockIndex* pindexBestHeader = NULL;
+map<uint256, int64> mapHeaderFailed;
+
+// Set when a block fails for a reason of our own, like a disk error,
+// rather than anything wrong with the block
+bool fBlockLocalError = false;
+map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+
+// The best block as a cmpctblock message and whole for getblocktxn, and
+// compact blocks waiting on blocktxn with their missing transactions null
+uint256 hashCompactBlock = 0;
+CSendBufferRef pbufCompactBlock;
+CBlock blockCompact;
+class CPartialBlock
+{
+public:
+    CNode* pfrom;
+    int64 nTime;
+    CBlock block;
+};
+map<uint256, CPartialBlock> mapPartialBlocks;
+int64 nCompactBlocksReceived = 0;
+int64 nCompactBlocksTxRequested = 0;
+int64 nCompactBlocksFailed = 0;
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
@@ -49,6 +78,10 @@ int nDropMessagesTest = 0;
 int fGenerateBitcoins;
 int64 nTransactionFee = 0;
 CAddress addrIncoming;
+int nBlockFileSync = BLOCKFILESYNC_NONE;
+unsigned int nBlockFileMaxSize = 0x7F000000;
+unsigned int nBlockFilePrealloc = 16 * 1024 * 1024;
+int nRescanThreads = 4;
 
 
 
@@ -177,6 +210,229 @@ bool EraseFromWallet(uint256 hash)
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Wallet rescan
+//
+
+// Workers take chunks of heights off the front so they all stream through
+// the same block files, and the merge takes chunks back in height order.
+class CRescanChunk
+{
+public:
+    int nBegin;
+    int nEnd;
+    bool fDone;
+    bool fFailed;
+    vector<CBlock> vBlock;
+
+    CRescanChunk(int nBeginIn, int nEndIn)
+    {
+        nBegin = nBeginIn;
+        nEnd = nEndIn;
+        fDone = false;
+        fFailed = false;
+    }
+};
+
+static CCriticalSection cs_rescan;
+static vector<pair<unsigned int, unsigned int> > vRescanPos;
+static vector<CRescanChunk> vRescanChunk;
+static int nRescanNextChunk = 0;
+static int nRescanWorkers = 0;
+static bool fRescanAbort = false;
+static CWakeEvent eventRescan;
+
+// Progress for the status bar, nRescanBlocksTotal is 0 when not scanning
+int nRescanBlocksDone = 0;
+int nRescanBlocksTotal = 0;
+
+void ThreadRescanWorker(void* parg)
+{
+    loop
+    {
+        CRescanChunk* pchunk = NULL;
+        CRITICAL_BLOCK(cs_rescan)
+            if (nRescanNextChunk < vRescanChunk.size() && !fRescanAbort)
+                pchunk = &vRescanChunk[nRescanNextChunk++];
+        if (!pchunk)
+            break;
+
+        // Only the IsMine tests here, nothing that needs cs_main
+        vector<CBlock> vBlock;
+        bool fFailed = false;
+        for (int i = pchunk->nBegin; i < pchunk->nEnd && !fFailed; i++)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(vRescanPos[i].first, vRescanPos[i].second, true))
+            {
+                fFailed = true;
+                break;
+            }
+            foreach(const CTransaction& tx, block.vtx)
+            {
+                if (tx.IsMine())
+                {
+                    vBlock.push_back(block);
+                    break;
+                }
+            }
+        }
+
+        CRITICAL_BLOCK(cs_rescan)
+        {
+            pchunk->vBlock.swap(vBlock);
+            pchunk->fFailed = fFailed;
+            pchunk->fDone = true;
+            nRescanBlocksDone += pchunk->nEnd - pchunk->nBegin;
+            if (fFailed)
+                fRescanAbort = true;
+        }
+        eventRescan.Set();
+    }
+
+    CRITICAL_BLOCK(cs_rescan)
+        nRescanWorkers--;
+    eventRescan.Set();
+}
+
+bool ScanForWalletTransactions(int nStartHeight)
+{
+    static bool fRunning = false;
+    CRITICAL_BLOCK(cs_rescan)
+    {
+        if (fRunning)
+            return error("ScanForWalletTransactions() : already running");
+        fRunning = true;
+    }
+    int64 nStart = GetTimeMicros();
+
+    // Block positions from the main chain as it is now
+    CRITICAL_BLOCK(cs_main)
+    {
+        vRescanPos.clear();
+        for (int i = max(nStartHeight, 0); i < vMainChain.size(); i++)
+            vRescanPos.push_back(make_pair(vMainChain[i]->nFile, vMainChain[i]->nBlockPos));
+    }
+    vRescanChunk.clear();
+    for (int i = 0; i < vRescanPos.size(); i += 500)
+        vRescanChunk.push_back(CRescanChunk(i, min(i + 500, (int)vRescanPos.size())));
+    nRescanNextChunk = 0;
+    fRescanAbort = false;
+    nRescanBlocksDone = 0;
+    nRescanBlocksTotal = vRescanPos.size();
+    printf("ScanForWalletTransactions() : scanning %d blocks from height %d\n", nRescanBlocksTotal, nStartHeight);
+
+    int nThreads = max(1, min(nRescanThreads, (int)vRescanChunk.size()));
+    nRescanWorkers = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        CRITICAL_BLOCK(cs_rescan)
+            nRescanWorkers++;
+        if (_beginthread(ThreadRescanWorker, 0, NULL) == -1)
+        {
+            printf("Error: _beginthread(ThreadRescanWorker) failed\n");
+            CRITICAL_BLOCK(cs_rescan)
+                nRescanWorkers--;
+        }
+    }
+    if (nRescanWorkers == 0)
+    {
+        // Do it on this thread then
+        nRescanWorkers = 1;
+        ThreadRescanWorker(NULL);
+    }
+
+    // Merge in height order as chunks come in
+    bool fOk = true;
+    int64 nLastProgress = GetTime();
+    int nFound = 0;
+    for (int nChunk = 0; nChunk < vRescanChunk.size() && fOk && !fShutdown; )
+    {
+        vector<CBlock> vBlock;
+        bool fReady = false;
+        CRITICAL_BLOCK(cs_rescan)
+        {
+            CRescanChunk& chunk = vRescanChunk[nChunk];
+            if (chunk.fDone)
+            {
+                fReady = true;
+                fOk = !chunk.fFailed;
+                vBlock.swap(chunk.vBlock);
+            }
+            else if (fRescanAbort || nRescanWorkers == 0)
+            {
+                fOk = false;
+            }
+        }
+        if (!fOk)
+            break;
+        if (!fReady)
+        {
+            // Workers set the event as each chunk finishes
+            eventRescan.Wait(1000);
+        }
+        else
+        {
+            CRITICAL_BLOCK(cs_main)
+            {
+                foreach(const CBlock& block, vBlock)
+                {
+                    foreach(const CTransaction& tx, block.vtx)
+                    {
+                        if (tx.IsMine())
+                        {
+                            bool fNew;
+                            CRITICAL_BLOCK(cs_mapWallet)
+                                fNew = !mapWallet.count(tx.GetHash());
+                            if (AddToWalletIfMine(tx, &block) && fNew)
+                                nFound++;
+                        }
+                    }
+                }
+            }
+            nChunk++;
+        }
+
+        if (GetTime() - nLastProgress >= 5)
+        {
+            nLastProgress = GetTime();
+            printf("ScanForWalletTransactions() : %d/%d blocks, %d new transactions\n", nRescanBlocksDone, nRescanBlocksTotal, nFound);
+            MainFrameRepaint();
+        }
+    }
+
+    // Let the workers run out before the shared state goes away
+    CRITICAL_BLOCK(cs_rescan)
+        fRescanAbort = true;
+    loop
+    {
+        int nWorkers;
+        CRITICAL_BLOCK(cs_rescan)
+            nWorkers = nRescanWorkers;
+        if (nWorkers == 0)
+            break;
+        eventRescan.Wait(1000);
+    }
+    vRescanPos.clear();
+    vRescanChunk.clear();
+
+    printf("ScanForWalletTransactions() : %s, %d new transactions in %d blocks, %I64dms\n", fOk ? "done" : "FAILED", nFound, nRescanBlocksDone, (GetTimeMicros() - nStart) / 1000);
+    nRescanBlocksTotal = 0;
+    CRITICAL_BLOCK(cs_rescan)
+        fRunning = false;
+    MainFrameRepaint();
+    return fOk;
+}
+
+
+
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -267,7 +523,7 @@ int64 CWalletTx::GetTxTime() const
         // If we did not receive the transaction directly, we rely on the block's
         // time to figure out when it happened.  We use the median over a range
         // of blocks to try to filter out inaccurate block times.
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -324,7 +580,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -518,7 +774,7 @@ int CMerkleTx::GetDepthInMainChain() const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -659,6 +915,174 @@ void RelayWalletTransactions()
 // CBlock and CBlockIndex
 //
 
+//
+// CBlockIndex objects are carved out of big chunks instead of one heap
+// allocation each, freed ones are kept on a list for reuse.  The chunks
+// are never given back, the block index only grows.
+//
+static CCriticalSection cs_BlockIndexArena;
+static vector<char*> vBlockIndexChunk;
+static vector<void*> vBlockIndexFree;
+static unsigned int nBlockIndexChunkUsed = 0;
+static const unsigned int nBlockIndexChunkSize = 4096;
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // Derived classes like CDiskBlockIndex are bigger, they get the heap
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+    CRITICAL_BLOCK(cs_BlockIndexArena)
+    {
+        if (!vBlockIndexFree.empty())
+        {
+            void* p = vBlockIndexFree.back();
+            vBlockIndexFree.pop_back();
+            return p;
+        }
+        if (vBlockIndexChunk.empty() || nBlockIndexChunkUsed == nBlockIndexChunkSize)
+        {
+            vBlockIndexChunk.push_back((char*)::operator new(nBlockIndexChunkSize * sizeof(CBlockIndex)));
+            nBlockIndexChunkUsed = 0;
+        }
+        return vBlockIndexChunk.back() + sizeof(CBlockIndex) * nBlockIndexChunkUsed++;
+    }
+    return NULL;
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (p == NULL)
+        return;
+    if (nSize != sizeof(CBlockIndex))
+    {
+        ::operator delete(p);
+        return;
+    }
+    CRITICAL_BLOCK(cs_BlockIndexArena)
+        vBlockIndexFree.push_back(p);
+}
+
+// Turn the lowest 1 bit of n into 0
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+static inline int GetSkipHeight(int nHeight)
+{
+    // Where the skip pointer of a block at nHeight points.  Any height
+    // below works, this spacing gets anywhere in O(log n) hops.
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    CBlockIndex* pindex = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightIn)
+    {
+        // Take the skip unless it overshoots, or it overshoots less than
+        // the prev's skip would
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindex->pskip && (nHeightSkip == nHeightIn ||
+            (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn))))
+        {
+            pindex = pindex->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            if (!pindex->pprev)
+                return NULL;
+            pindex = pindex->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindex;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
+unsigned int ReadBlockTxCount(unsigned int nFile, unsigned int nBlockPos)
+{
+    // Number of transactions in a block on disk, 0 if it can't be read
+    try
+    {
+        CBlockFileStream filein(nFile, nBlockPos);
+        if (!filein)
+            return 0;
+        CBlock block;
+        filein.nType |= SER_BLOCKHEADERONLY;
+        filein >> block;
+        return ReadCompactSize(filein);
+    }
+    catch (std::exception& e)
+    {
+        return 0;
+    }
+}
+
+void CBlockIndex::CacheChainValues()
+{
+    // pprev must have its values already
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    CBigNum bnWork = (bnTarget <= 0 ? 0 : (CBigNum(1) << 256) / (bnTarget + 1));
+    nChainWork = (pprev ? pprev->nChainWork : 0);
+    nChainWork += bnWork.getuint256();
+    nMedianTimePast = ComputeMedianTimePast();
+}
+
+void SetMainChain(CBlockIndex* pindexTip)
+{
+    // Only the part above the fork with the old chain is rewritten
+    if (!pindexTip)
+    {
+        vMainChain.clear();
+        return;
+    }
+    vMainChain.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vMainChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vMainChain[pindex->nHeight] = pindex;
+}
+
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
+{
+    // Bring both to the same height, then step back together
+    if (!pa || !pb)
+        return NULL;
+    if (pa->nHeight > pb->nHeight)
+        pa = pa->GetAncestor(pb->nHeight);
+    else if (pb->nHeight > pa->nHeight)
+        pb = pb->GetAncestor(pa->nHeight);
+    while (pa != pb && pa && pb)
+    {
+        if (pa->pskip && pb->pskip && pa->pskip != pb->pskip)
+        {
+            pa = pa->pskip;
+            pb = pb->pskip;
+        }
+        else
+        {
+            pa = pa->pprev;
+            pb = pb->pprev;
+        }
+    }
+    return (pa == pb ? pa : NULL);
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pblockindex, bool fReadTransactions)
 {
     return ReadFromDisk(pblockindex->nFile, pblockindex->nBlockPos, fReadTransactions);
@@ -697,9 +1121,7 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
         return pindexLast->nBits;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -736,8 +1158,16 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+bool CTransaction::DisconnectInputs(CTxDB& txdb, CDiskTxPos posThisTx, const map<uint256, const CTransaction*>& mapBlockTx)
 {
+    // Owner index entries are keyed by owner and this transaction's position
+    foreach(const CTxOut& txout, vout)
+    {
+        uint160 hash160;
+        if (ExtractOwnerHash160(txout.scriptPubKey, hash160))
+            txdb.EraseOwnerTx(hash160, posThisTx);
+    }
+
     // Relinquish previous transactions' spent pointers
     if (!IsCoinBase())
     {
@@ -753,6 +1183,25 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             if (prevout.n >= txindex.vSpent.size())
                 return error("DisconnectInputs() : prevout.n out of range");
 
+            // Drop the entry for the owner it spent from, derived from the
+            // prev output the same way ConnectInputs did
+            CTransaction txPrevRead;
+            const CTransaction* ptxPrev = NULL;
+            map<uint256, const CTransaction*>::const_iterator mi = mapBlockTx.find(prevout.hash);
+            if (mi != mapBlockTx.end())
+            {
+                ptxPrev = (*mi).second;
+            }
+            else
+            {
+                if (!txPrevRead.ReadFromDisk(txindex.pos))
+                    return error("DisconnectInputs() : ReadFromDisk prev tx failed");
+                ptxPrev = &txPrevRead;
+            }
+            uint160 hash160;
+            if (prevout.n < ptxPrev->vout.size() && ExtractOwnerHash160(ptxPrev->vout[prevout.n].scriptPubKey, hash160))
+                txdb.EraseOwnerTx(hash160, posThisTx);
+
             // Mark outpoint as not spent
             txindex.vSpent[prevout.n].SetNull();
 
@@ -769,7 +1218,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee, CBlockUndo* pundo)
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
@@ -813,7 +1262,10 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             {
                 // Get prev tx from disk
                 if (!txPrev.ReadFromDisk(txindex.pos))
+                {
+                    fBlockLocalError = true;
                     return error("ConnectInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,6).c_str(),  prevout.hash.ToString().substr(0,6).c_str());
+                }
             }
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
@@ -821,18 +1273,35 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
 
             // If prev is coinbase, check that it's matured
             if (txPrev.IsCoinBase())
-                for (CBlockIndex* pindex = pindexBest; pindex && nBestHeight - pindex->nHeight < COINBASE_MATURITY-1; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
+            {
+                // Its block's header gives the index entry and the height
+                CBlock blockPrev;
+                if (!blockPrev.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                {
+                    fBlockLocalError = true;
+                    return error("ConnectInputs() : %s ReadFromDisk coinbase block failed", GetHash().ToString().substr(0,6).c_str());
+                }
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(blockPrev.GetHash());
+                if (mi != mapBlockIndex.end())
+                {
+                    CBlockIndex* pindex = (*mi).second;
+                    if (pindex->IsInMainChain() && nBestHeight - pindex->nHeight < COINBASE_MATURITY-1)
                         return error("ConnectInputs() : tried to spend coinbase at depth %d", nBestHeight - pindex->nHeight);
+                }
+            }
 
-            // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            // Verify signature, usually already done by the message handler
+            if (!VerifySignatureCached(txPrev, *this, i))
                 return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,6).c_str());
 
             // Check for conflicts
             if (!txindex.vSpent[prevout.n].IsNull())
                 return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,6).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
 
+            // Remember the entry as it was for undo
+            if (pundo)
+                pundo->AddPrevTxIndex(prevout.hash, txindex);
+
             // Mark outpoints as spent
             txindex.vSpent[prevout.n] = posThisTx;
 
@@ -842,6 +1311,19 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             else if (fMiner)
                 mapTestPool[prevout.hash] = txindex;
 
+            // The spender shows up in the history of the owner it spent from
+            uint160 hash160;
+            if (fBlock && ExtractOwnerHash160(txPrev.vout[prevout.n].scriptPubKey, hash160))
+            {
+                if (!txdb.AddOwnerTx(hash160, posThisTx, nHeight))
+                {
+                    fBlockLocalError = true;
+                    return error("ConnectInputs() : AddOwnerTx failed");
+                }
+                if (pundo)
+                    pundo->vOwnerAdded.push_back(make_pair(hash160, posThisTx));
+            }
+
             nValueIn += txPrev.vout[prevout.n].nValue;
         }
 
@@ -859,6 +1341,16 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
         // Add transaction to disk index
         if (!txdb.AddTxIndex(*this, posThisTx, nHeight))
             return error("ConnectInputs() : AddTxPos failed");
+        if (pundo)
+        {
+            pundo->vTxAdded.push_back(GetHash());
+            foreach(const CTxOut& txout, vout)
+            {
+                uint160 hash160;
+                if (ExtractOwnerHash160(txout.scriptPubKey, hash160))
+                    pundo->vOwnerAdded.push_back(make_pair(hash160, posThisTx));
+            }
+        }
     }
     else if (fMiner)
     {
@@ -917,20 +1409,42 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
+    // Put back the index entries the block changed from its undo record
+    CBlockUndo undo;
+    if (txdb.ReadBlockUndo(pindex->GetBlockHash(), undo))
+    {
+        foreach(const PAIRTYPE(uint256, CTxIndex)& item, undo.mapPrevTxIndex)
+            if (!txdb.UpdateTxIndex(item.first, item.second))
+                return error("DisconnectBlock() : UpdateTxIndex failed");
+        foreach(const uint256& hash, undo.vTxAdded)
+            if (!txdb.EraseTxIndex(hash))
+                return error("DisconnectBlock() : EraseTxIndex failed");
+        foreach(const PAIRTYPE(uint160, CDiskTxPos)& item, undo.vOwnerAdded)
+            if (!txdb.EraseOwnerTx(item.first, item.second))
+                return error("DisconnectBlock() : EraseOwnerTx failed");
+        return txdb.EraseBlockUndo(pindex->GetBlockHash());
+    }
 
-    // Update block index on disk without changing it in memory.
-    // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
+    // Blocks connected before undo records existed
+    if (vtx.empty() && !ReadFromDisk(pindex, true))
+        return error("DisconnectBlock() : ReadFromDisk failed");
+
+    // Positions as ConnectBlock gave them, the owner index is keyed by them
+    vector<CDiskTxPos> vPos;
+    map<uint256, const CTransaction*> mapBlockTx;
+    unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
+    foreach(const CTransaction& tx, vtx)
     {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = 0;
-        txdb.WriteBlockIndex(blockindexPrev);
+        vPos.push_back(CDiskTxPos(pindex->nFile, pindex->nBlockPos, nTxPos));
+        nTxPos += ::GetSerializeSize(tx, SER_DISK);
+        mapBlockTx[tx.GetHash()] = &tx;
     }
 
+    // Disconnect in reverse order
+    for (int i = vtx.size()-1; i >= 0; i--)
+        if (!vtx[i].DisconnectInputs(txdb, vPos[i], mapBlockTx))
+            return false;
+
     return true;
 }
 
@@ -940,28 +1454,32 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapUnused;
+    CBlockUndo undo;
     int64 nFees = 0;
     foreach(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false))
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false, 0, &undo))
             return false;
     }
 
     if (vtx[0].GetValueOut() > GetBlockValue(nFees))
         return false;
 
-    // Update block index on disk without changing it in memory.
-    // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
+    // So DisconnectBlock can take it back off in one batch
+    if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
     {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = pindex->GetBlockHash();
-        txdb.WriteBlockIndex(blockindexPrev);
+        fBlockLocalError = true;
+        return error("ConnectBlock() : WriteBlockUndo failed");
     }
 
+    // Reorgs deeper than this are rare enough to take the slow path
+    // without an undo record
+    if (pindex->nHeight >= UNDO_KEEP_DEPTH)
+        txdb.EraseBlockUndo(pindex->GetAncestor(pindex->nHeight - UNDO_KEEP_DEPTH)->GetBlockHash());
+
     // Watch for transactions paying to me
     foreach(CTransaction& tx, vtx)
         AddToWalletIfMine(tx, this);
@@ -976,16 +1494,9 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("*** REORGANIZE ***\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-    }
+    CBlockIndex* pfork = LastCommonAncestor(pindexBest, pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no common ancestor");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -998,20 +1509,16 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         vConnect.push_back(pindex);
     reverse(vConnect.begin(), vConnect.end());
 
-    // Disconnect shorter branch
-    vector<CTransaction> vResurrect;
+    // Disconnect shorter branch, the undo records mean the blocks
+    // don't have to be read for this
     foreach(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
-        if (!block.ReadFromDisk(pindex->nFile, pindex->nBlockPos, true))
-            return error("Reorganize() : ReadFromDisk for disconnect failed");
         if (!block.DisconnectBlock(txdb, pindex))
+        {
+            fBlockLocalError = true;
             return error("Reorganize() : DisconnectBlock failed");
-
-        // Queue memory transactions to resurrect
-        foreach(const CTransaction& tx, block.vtx)
-            if (!tx.IsCoinBase())
-                vResurrect.push_back(tx);
+        }
     }
 
     // Connect longer branch
@@ -1021,11 +1528,14 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlockIndex* pindex = vConnect[i];
         CBlock block;
         if (!block.ReadFromDisk(pindex->nFile, pindex->nBlockPos, true))
+        {
+            fBlockLocalError = true;
             return error("Reorganize() : ReadFromDisk for connect failed");
+        }
         if (!block.ConnectBlock(txdb, pindex))
         {
             // Invalid block, delete the rest of this branch
-            txdb.TxnAbort();
+            txdb.BatchAbort();
             for (int j = i; j < vConnect.size(); j++)
             {
                 CBlockIndex* pindex = vConnect[j];
@@ -1042,10 +1552,17 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             vDelete.push_back(tx);
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
+    {
+        fBlockLocalError = true;
         return error("Reorganize() : WriteHashBestChain failed");
+    }
 
     // Commit now because resurrecting could take some time
-    txdb.TxnCommit();
+    if (!txdb.BatchCommit())
+    {
+        fBlockLocalError = true;
+        return error("Reorganize() : BatchCommit failed");
+    }
 
     // Disconnect shorter branch
     foreach(CBlockIndex* pindex, vDisconnect)
@@ -1058,6 +1575,16 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             pindex->pprev->pnext = pindex;
 
     // Resurrect memory transactions that were in the disconnected branch
+    vector<CTransaction> vResurrect;
+    foreach(CBlockIndex* pindex, vDisconnect)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex, true))
+            continue;
+        foreach(const CTransaction& tx, block.vtx)
+            if (!tx.IsCoinBase())
+                vResurrect.push_back(tx);
+    }
     foreach(CTransaction& tx, vResurrect)
         tx.AcceptTransaction(txdb, false);
 
@@ -1080,21 +1607,24 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
+    pindexNew->CacheChainValues();
 
+    // Everything written for this block goes out as one sorted commit
     CTxDB txdb;
-    txdb.TxnBegin();
+    txdb.BatchBegin();
     txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
 
-    // New best
-    if (pindexNew->nHeight > nBestHeight)
+    // New best, by total work the same as the header chain
+    if (!pindexBest || pindexNew->nChainWork > pindexBest->nChainWork)
     {
         if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
         {
@@ -1104,15 +1634,20 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         else if (hashPrevBlock == hashBestChain)
         {
             // Adding to current best branch
-            if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
+            bool fConnected = ConnectBlock(txdb, pindexNew);
+            if (fConnected && (!txdb.WriteHashBestChain(hash) || !txdb.BatchCommit()))
+            {
+                fBlockLocalError = true;
+                fConnected = false;
+            }
+            if (!fConnected)
             {
-                txdb.TxnAbort();
+                txdb.BatchAbort();
                 pindexNew->EraseBlockFromDisk();
                 mapBlockIndex.erase(pindexNew->GetBlockHash());
                 delete pindexNew;
                 return error("AddToBlockIndex() : ConnectBlock failed");
             }
-            txdb.TxnCommit();
             pindexNew->pprev->pnext = pindexNew;
 
             // Delete redundant memory transactions
@@ -1124,7 +1659,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
             // New best branch
             if (!Reorganize(txdb, pindexNew))
             {
-                txdb.TxnAbort();
+                txdb.BatchAbort();
                 return error("AddToBlockIndex() : Reorganize failed");
             }
         }
@@ -1133,11 +1668,23 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         hashBestChain = hash;
         pindexBest = pindexNew;
         nBestHeight = pindexBest->nHeight;
+        SetMainChain(pindexBest);
         nTransactionsUpdated++;
         printf("AddToBlockIndex: new best=%s  height=%d\n", hashBestChain.ToString().substr(0,14).c_str(), nBestHeight);
     }
 
-    txdb.TxnCommit();
+    // No-op if the batch was already committed above
+    txdb.BatchCommit();
+
+    // Snapshot the block index now and then for fast startup
+    static int64 nLastSnapshot;
+    if (nLastSnapshot == 0)
+        nLastSnapshot = GetTime();
+    if (GetTime() - nLastSnapshot > 60 * 60)
+    {
+        nLastSnapshot = GetTime();
+        StartBlockIndexSnapshot(txdb);
+    }
     txdb.Close();
 
     // Relay wallet transactions that haven't gotten in yet
@@ -1186,6 +1733,14 @@ bool CBlock::CheckBlock() const
     if (hashMerkleRoot != BuildMerkleTree())
         return error("CheckBlock() : hashMerkleRoot mismatch");
 
+    // Repeating the last transactions of a level leaves the merkle root
+    // unchanged, so a copy of a good block can be made that fails to
+    // connect.  Such a block could never connect anyway.
+    set<uint256> setTxHash;
+    foreach(const CTransaction& tx, vtx)
+        if (!setTxHash.insert(tx.GetHash()).second)
+            return error("CheckBlock() : duplicate transaction");
+
     return true;
 }
 
@@ -1197,7 +1752,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return error("AcceptBlock() : prev block not found");
     CBlockIndex* pindexPrev = (*mi).second;
@@ -1214,12 +1769,25 @@ bool CBlock::AcceptBlock()
     unsigned int nFile;
     unsigned int nBlockPos;
     if (!WriteToDisk(!fClient, nFile, nBlockPos))
+    {
+        fBlockLocalError = true;
         return error("AcceptBlock() : WriteToDisk failed");
+    }
     if (!AddToBlockIndex(nFile, nBlockPos))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
     if (hashBestChain == hash)
+    {
+        // Every peer is about to ask for it
+        AddBlockMessage(*this, false);
+        AddBlockMessage(*this, true);
+        CDataStream ss;
+        ss << CCompactBlock(*this);
+        hashCompactBlock = hash;
+        pbufCompactBlock = MakeMessageBuffer("cmpctblock", ss);
+        blockCompact = *this;
         RelayInventory(CInv(MSG_BLOCK, hash));
+    }
 
     // // Add atoms to user reviews for coins created
     // vector<unsigned char> vchPubKey;
@@ -1233,18 +1801,112 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+//
+// Checks the message handler threads do before taking cs_main
+//
+
+// Inputs whose signatures have checked out, keyed by the spending tx and
+// input.  The tx hash commits to the output spent, so a hit stays good.
+static const unsigned int MAX_SIGCHECKED = 100000;
+set<pair<uint256, unsigned int> > setSigChecked;
+CCriticalSection cs_setSigChecked;
+
+bool VerifySignatureCached(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn)
 {
-    // Check for duplicate
-    uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,14).c_str());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,14).c_str());
+    pair<uint256, unsigned int> key(txTo.GetHash(), nIn);
+    CRITICAL_BLOCK(cs_setSigChecked)
+        if (setSigChecked.count(key))
+            return true;
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
-    {
+    if (!VerifySignature(txFrom, txTo, nIn))
+        return false;
+
+    CRITICAL_BLOCK(cs_setSigChecked)
+    {
+        if (setSigChecked.size() >= MAX_SIGCHECKED)
+        {
+            // Evict one at random
+            uint256 hashRand;
+            RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+            set<pair<uint256, unsigned int> >::iterator it = setSigChecked.lower_bound(make_pair(hashRand, 0U));
+            setSigChecked.erase(it != setSigChecked.end() ? it : setSigChecked.begin());
+        }
+        setSigChecked.insert(key);
+    }
+    return true;
+}
+
+bool PreCheckTransaction(const CTransaction& tx, const map<uint256, const CTransaction*>* pmapBlockTx)
+{
+    // CheckTransaction plus the signatures of inputs whose previous tx is
+    // already in this block, the memory pool or on disk.  Inputs we can't
+    // find are left to AcceptTransaction, which knows about orphans.
+    if (!tx.CheckTransaction())
+        return false;
+    if (tx.IsCoinBase())
+        return true;
+
+    CTxDB txdb("r");
+    for (int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        CTransaction txPrev;
+        bool fFound = false;
+        if (pmapBlockTx)
+        {
+            map<uint256, const CTransaction*>::const_iterator mi = pmapBlockTx->find(prevout.hash);
+            if (mi != pmapBlockTx->end())
+            {
+                txPrev = *(*mi).second;
+                fFound = true;
+            }
+        }
+        if (!fFound)
+        {
+            CRITICAL_BLOCK(cs_mapTransactions)
+            {
+                map<uint256, CTransaction>::iterator mi = mapTransactions.find(prevout.hash);
+                if (mi != mapTransactions.end())
+                {
+                    txPrev = (*mi).second;
+                    fFound = true;
+                }
+            }
+        }
+        if (!fFound)
+            fFound = txdb.ReadDiskTx(prevout.hash, txPrev);
+        if (!fFound || prevout.n >= txPrev.vout.size())
+            continue;
+
+        if (!VerifySignatureCached(txPrev, tx, i))
+            return error("PreCheckTransaction() : %s VerifySignature failed", tx.GetHash().ToString().substr(0,6).c_str());
+    }
+    return true;
+}
+
+bool PreCheckBlockSignatures(const CBlock& block)
+{
+    map<uint256, const CTransaction*> mapBlockTx;
+    foreach(const CTransaction& tx, block.vtx)
+        mapBlockTx[tx.GetHash()] = &tx;
+    foreach(const CTransaction& tx, block.vtx)
+        if (!PreCheckTransaction(tx, &mapBlockTx))
+            return false;
+    return true;
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked)
+{
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,14).c_str());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,14).c_str());
+
+    // Preliminary checks, the message handler does them before taking cs_main
+    if (!fChecked && !pblock->CheckBlock())
+    {
         delete pblock;
         return error("ProcessBlock() : CheckBlock FAILED");
     }
@@ -1256,9 +1918,15 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock));
         mapOrphanBlocksByPrev.insert(make_pair(pblock->hashPrevBlock, pblock));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushMessage("getblocks", CBlockLocator(pindexBest), GetOrphanRoot(pblock));
+        // Ask this guy to fill in what we're missing.  Blocks fetched off the
+        // header chain come in out of order, their parents are on the way.
+        if (pfrom && !mapHeaderIndex.count(pblock->hashPrevBlock))
+        {
+            if (pfrom->fHaveHeaders)
+                pfrom->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+            else
+                pfrom->PushMessage("getblocks", CBlockLocator(pindexBest), GetOrphanRoot(pblock));
+        }
         return true;
     }
 
@@ -1385,7 +2053,11 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
     {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+#ifdef _MSC_VER
+        if (_fseeki64(file, nBlockPos, SEEK_SET) != 0)
+#else
+        if (fseeko64(file, nBlockPos, SEEK_SET) != 0)
+#endif
         {
             fclose(file);
             return NULL;
@@ -1394,29 +2066,356 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+//
+// Block file writer
+//
+// The block file being appended to stays open and is grown in
+// preallocated chunks of nBlockFilePrealloc so it doesn't fragment.
+// Where the data ends is tracked here rather than asked of the file,
+// the zeroed tail past it is cut off when the file is rolled over or
+// closed.  On startup the end is taken from the last block in the index,
+// anything after that was never indexed and is written over.
+//
+
+static CCriticalSection cs_BlockFile;
 static unsigned int nCurrentBlockFile = 1;
+static HANDLE hBlockFile = INVALID_HANDLE_VALUE;
+static unsigned int nBlockFileDataEnd = 0;
+static unsigned int nBlockFileAllocEnd = 0;
+static int64 nBlockFileLastSync = 0;
+static bool fBlockFileInit = false;
+
+static bool SetBlockFileSize(unsigned int nSize)
+{
+    LONG nHigh = 0;
+    if (SetFilePointer(hBlockFile, nSize, &nHigh, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
+        return false;
+    return SetEndOfFile(hBlockFile);
+}
+
+static void CloseBlockFileHandle()
+{
+    if (hBlockFile == INVALID_HANDLE_VALUE)
+        return;
+    if (nBlockFileAllocEnd > nBlockFileDataEnd && !SetBlockFileSize(nBlockFileDataEnd))
+        printf("CloseBlockFile() : trimming blk%04d.dat failed %d\n", nCurrentBlockFile, GetLastError());
+    if (nBlockFileSync != BLOCKFILESYNC_NONE)
+        FlushFileBuffers(hBlockFile);
+    CloseHandle(hBlockFile);
+    hBlockFile = INVALID_HANDLE_VALUE;
+}
+
+static bool OpenBlockFileHandle()
+{
+    string strFile = strprintf("%s\\blk%04d.dat", GetAppDir().c_str(), nCurrentBlockFile);
+    hBlockFile = CreateFile(strFile.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hBlockFile == INVALID_HANDLE_VALUE)
+        return error("OpenBlockFileHandle() : CreateFile %s failed %d", strFile.c_str(), GetLastError());
+    DWORD nSize = GetFileSize(hBlockFile, NULL);
+    if (nSize == INVALID_FILE_SIZE)
+    {
+        CloseHandle(hBlockFile);
+        hBlockFile = INVALID_HANDLE_VALUE;
+        return error("OpenBlockFileHandle() : GetFileSize %s failed", strFile.c_str());
+    }
+    nBlockFileAllocEnd = nSize;
+    if (nBlockFileDataEnd > nBlockFileAllocEnd)
+        nBlockFileDataEnd = nBlockFileAllocEnd;
+    nBlockFileLastSync = GetTime();
+    return true;
+}
+
+static bool InitBlockFile()
+{
+    // Continue after the last block in the index
+    CBlockIndex* pindexLast = NULL;
+    foreach(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (!pindexLast || pindex->nFile > pindexLast->nFile ||
+            (pindex->nFile == pindexLast->nFile && pindex->nBlockPos > pindexLast->nBlockPos))
+            pindexLast = pindex;
+    }
+    nCurrentBlockFile = 1;
+    nBlockFileDataEnd = 0;
+    if (pindexLast && pindexLast->nFile != -1)
+    {
+        // The size is written just in front of the block.  Starting over
+        // at file 1 would write over the blocks we have.
+        CAutoFile filein = OpenBlockFile(pindexLast->nFile, pindexLast->nBlockPos - sizeof(unsigned int), "rb");
+        if (!filein)
+            return error("InitBlockFile() : can't open blk%04d.dat to find its end", pindexLast->nFile);
+        unsigned int nSize = 0;
+        filein >> nSize;
+        nCurrentBlockFile = pindexLast->nFile;
+        nBlockFileDataEnd = pindexLast->nBlockPos + nSize;
+    }
+    fBlockFileInit = true;
+    return true;
+}
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
+bool AppendBlockFile(const CDataStream& ss, unsigned int& nFileRet, unsigned int& nPosRet)
 {
     nFileRet = 0;
-    loop
+    nPosRet = 0;
+    unsigned int nRecordSize = ss.size();
+    if (nRecordSize > nBlockFileMaxSize)
+        return error("AppendBlockFile() : record larger than nBlockFileMaxSize");
+    CRITICAL_BLOCK(cs_BlockFile)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < 0x7F000000 - MAX_SIZE)
+        if (!fBlockFileInit && !InitBlockFile())
+            return false;
+
+        // Roll over to the next file when this one is full
+        if (hBlockFile != INVALID_HANDLE_VALUE && nBlockFileDataEnd + nRecordSize > nBlockFileMaxSize)
+        {
+            CloseBlockFileHandle();
+            nCurrentBlockFile++;
+            nBlockFileDataEnd = 0;
+        }
+        if (hBlockFile == INVALID_HANDLE_VALUE)
+        {
+            loop
+            {
+                if (!OpenBlockFileHandle())
+                    return false;
+                if (nBlockFileDataEnd + nRecordSize <= nBlockFileMaxSize)
+                    break;
+                CloseBlockFileHandle();
+                nCurrentBlockFile++;
+                nBlockFileDataEnd = 0;
+            }
+        }
+
+        // Grow the file a chunk at a time
+        if (nBlockFileDataEnd + nRecordSize > nBlockFileAllocEnd)
+        {
+            unsigned int nNewEnd = max(nBlockFileDataEnd + nRecordSize, min(nBlockFileAllocEnd + nBlockFilePrealloc, nBlockFileMaxSize));
+            if (SetBlockFileSize(nNewEnd))
+                nBlockFileAllocEnd = nNewEnd;
+            else
+                printf("AppendBlockFile() : preallocate blk%04d.dat to %u failed %d\n", nCurrentBlockFile, nNewEnd, GetLastError());
+        }
+
+        // Write at the data end
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = nBlockFileDataEnd;
+        DWORD nWritten = 0;
+        if (!WriteFile(hBlockFile, &ss[0], nRecordSize, &nWritten, &overlapped) || nWritten != nRecordSize)
+            return error("AppendBlockFile() : WriteFile failed %d", GetLastError());
+        nFileRet = nCurrentBlockFile;
+        nPosRet = nBlockFileDataEnd;
+        nBlockFileDataEnd += nRecordSize;
+        if (nBlockFileAllocEnd < nBlockFileDataEnd)
+            nBlockFileAllocEnd = nBlockFileDataEnd;
+
+        if (nBlockFileSync == BLOCKFILESYNC_BLOCK ||
+            (nBlockFileSync == BLOCKFILESYNC_PERIODIC && GetTime() - nBlockFileLastSync >= 60))
+        {
+            FlushFileBuffers(hBlockFile);
+            nBlockFileLastSync = GetTime();
+        }
+    }
+    return true;
+}
+
+unsigned int GetBlockFileDataSize(unsigned int nFile, unsigned int nSize)
+{
+    // Where the valid data in a file ends, the file may be preallocated past it
+    CRITICAL_BLOCK(cs_BlockFile)
+        if (hBlockFile != INVALID_HANDLE_VALUE && nFile == nCurrentBlockFile)
+            return min(nSize, nBlockFileDataEnd);
+    return nSize;
+}
+
+void CloseBlockFile()
+{
+    CRITICAL_BLOCK(cs_BlockFile)
+        CloseBlockFileHandle();
+}
+
+//
+// Block file views
+//
+// Block files are mapped read-only in windows of up to 64MB starting just
+// below the position being read.  A window runs at least MAX_SIZE past
+// its start or to the end of the data at the time it was mapped, so a
+// block or transaction that starts in it also ends in it.  When no cached
+// window has the position, a new one is mapped and the least recently
+// used is retired.  Retired views are unmapped when the last stream using
+// them is done.
+//
+
+class CBlockFileView
+{
+public:
+    unsigned int nFile;
+    unsigned int nOffset;
+    const char* pbegin;
+    unsigned int nSize;
+    bool fDataEnd;
+    int nRefCount;
+    int64 nLastUsed;
+    bool fRetired;
+
+    CBlockFileView(unsigned int nFileIn, unsigned int nOffsetIn, const char* pbeginIn, unsigned int nSizeIn, bool fDataEndIn)
+    {
+        nFile = nFileIn;
+        nOffset = nOffsetIn;
+        pbegin = pbeginIn;
+        nSize = nSizeIn;
+        fDataEnd = fDataEndIn;
+        nRefCount = 0;
+        nLastUsed = 0;
+        fRetired = false;
+    }
+
+    ~CBlockFileView()
+    {
+        UnmapViewOfFile(pbegin);
+    }
+
+    bool Contains(unsigned int nFileIn, unsigned int nPos) const
+    {
+        if (nFileIn != nFile || nPos < nOffset || nPos - nOffset >= nSize)
+            return false;
+        return (fDataEnd || nSize - (nPos - nOffset) >= MAX_SIZE);
+    }
+};
+
+static CCriticalSection cs_mapBlockFileView;
+static list<CBlockFileView*> listBlockFileView;
+static int64 nBlockFileViewCounter = 0;
+
+// 256MB of address space at most, which a 32-bit process can spare
+static const unsigned int nBlockFileViewSize = 64 * 1024 * 1024;
+static const int nMaxBlockFileViews = 4;
+
+static CBlockFileView* MapBlockFile(unsigned int nFile, unsigned int nPos)
+{
+    static unsigned int nGranularity;
+    if (nGranularity == 0)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        nGranularity = info.dwAllocationGranularity;
+    }
+
+    string strFile = strprintf("%s\\blk%04d.dat", GetAppDir().c_str(), nFile);
+    HANDLE hFile = CreateFile(strFile.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        printf("MapBlockFile() : can't open blk%04d.dat %d\n", nFile, GetLastError());
+        return NULL;
+    }
+    DWORD nDataEnd = GetFileSize(hFile, NULL);
+    if (nDataEnd != INVALID_FILE_SIZE)
+        nDataEnd = GetBlockFileDataSize(nFile, nDataEnd);
+    if (nDataEnd == INVALID_FILE_SIZE || nPos >= nDataEnd)
+    {
+        CloseHandle(hFile);
+        return NULL;
+    }
+
+    // Mapping no further than the data end lets the writer trim its
+    // preallocated tail.  The view keeps the mapping and the file open, the handles can go
+    HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, nDataEnd, NULL);
+    CloseHandle(hFile);
+    if (hMapping == NULL)
+    {
+        printf("MapBlockFile() : CreateFileMapping blk%04d.dat failed %d\n", nFile, GetLastError());
+        return NULL;
+    }
+    unsigned int nOffset = nPos - nPos % nGranularity;
+    unsigned int nSize = min(nBlockFileViewSize, (unsigned int)nDataEnd - nOffset);
+    const char* pbegin = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, nOffset, nSize);
+    if (pbegin == NULL)
+        printf("MapBlockFile() : MapViewOfFile blk%04d.dat at %u size %u failed %d\n", nFile, nOffset, nSize, GetLastError());
+    CloseHandle(hMapping);
+    if (pbegin == NULL)
+        return NULL;
+
+    return new CBlockFileView(nFile, nOffset, pbegin, nSize, nOffset + nSize == nDataEnd);
+}
+
+static void RetireBlockFileView(CBlockFileView* pview)
+{
+    // cs_mapBlockFileView must be held
+    listBlockFileView.remove(pview);
+    if (pview->nRefCount == 0)
+        delete pview;
+    else
+        pview->fRetired = true;
+}
+
+static CBlockFileView* AcquireBlockFileView(unsigned int nFile, unsigned int nPos)
+{
+    if (nFile == -1)
+        return NULL;
+    CRITICAL_BLOCK(cs_mapBlockFileView)
+    {
+        CBlockFileView* pview = NULL;
+        for (list<CBlockFileView*>::iterator it = listBlockFileView.begin(); it != listBlockFileView.end(); ++it)
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            if ((*it)->Contains(nFile, nPos))
+            {
+                pview = *it;
+                break;
+            }
+        }
+        if (!pview)
+        {
+            // Map a window at the position, this also takes in what was
+            // appended since the file's other windows were mapped
+            pview = MapBlockFile(nFile, nPos);
+            if (!pview)
+                return NULL;
+            listBlockFileView.push_back(pview);
+
+            // Drop the least recently used view
+            if (listBlockFileView.size() > nMaxBlockFileViews)
+            {
+                CBlockFileView* pviewOldest = NULL;
+                foreach(CBlockFileView* pviewCached, listBlockFileView)
+                    if (pviewCached != pview && (!pviewOldest || pviewCached->nLastUsed < pviewOldest->nLastUsed))
+                        pviewOldest = pviewCached;
+                if (pviewOldest)
+                    RetireBlockFileView(pviewOldest);
+            }
         }
-        fclose(file);
-        nCurrentBlockFile++;
+        pview->nRefCount++;
+        pview->nLastUsed = ++nBlockFileViewCounter;
+        return pview;
+    }
+    return NULL;
+}
+
+static void ReleaseBlockFileView(CBlockFileView* pview)
+{
+    CRITICAL_BLOCK(cs_mapBlockFileView)
+    {
+        if (--pview->nRefCount == 0 && pview->fRetired)
+            delete pview;
+    }
+}
+
+CBlockFileStream::CBlockFileStream(unsigned int nFile, unsigned int nPos, int nTypeIn, int nVersionIn) : CMemoryStream(NULL, NULL, nTypeIn, nVersionIn)
+{
+    pview = AcquireBlockFileView(nFile, nPos);
+    if (pview)
+    {
+        SetBuffer(pview->pbegin, pview->pbegin + pview->nSize);
+        seek(nPos - pview->nOffset);
     }
 }
 
+CBlockFileStream::~CBlockFileStream()
+{
+    if (pview)
+        ReleaseBlockFileView(pview);
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     //
@@ -1427,6 +2426,11 @@ bool LoadBlockIndex(bool fAllowNew)
         return false;
     txdb.Close();
 
+    // Find where to append before anything gets written
+    CRITICAL_BLOCK(cs_BlockFile)
+        if (!InitBlockFile())
+            return false;
+
     //
     // Init with genesis block
     //
@@ -1491,13 +2495,75 @@ bool LoadBlockIndex(bool fAllowNew)
     return true;
 }
 
+bool RebuildOwnerIndex()
+{
+    // For chains connected before the owner index existed
+    CTxDB txdb;
+    if (!txdb.EraseOwnerIndex())
+        return error("RebuildOwnerIndex() : EraseOwnerIndex failed");
+
+    int nEntries = 0;
+    for (int nHeight = 0; nHeight < vMainChain.size(); nHeight += 500)
+    {
+        txdb.BatchBegin();
+        for (int i = nHeight; i < vMainChain.size() && i < nHeight + 500; i++)
+        {
+            CBlockIndex* pindex = vMainChain[i];
+            CBlock block;
+            if (!block.ReadFromDisk(pindex, true))
+            {
+                txdb.BatchAbort();
+                return error("RebuildOwnerIndex() : ReadFromDisk failed at height %d", i);
+            }
+
+            unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(block.vtx.size());
+            foreach(const CTransaction& tx, block.vtx)
+            {
+                CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
+                nTxPos += ::GetSerializeSize(tx, SER_DISK);
+
+                uint160 hash160;
+                foreach(const CTxOut& txout, tx.vout)
+                {
+                    if (ExtractOwnerHash160(txout.scriptPubKey, hash160))
+                    {
+                        txdb.AddOwnerTx(hash160, posThisTx, i);
+                        nEntries++;
+                    }
+                }
+
+                if (tx.IsCoinBase())
+                    continue;
+                foreach(const CTxIn& txin, tx.vin)
+                {
+                    CTransaction txPrev;
+                    if (!txdb.ReadDiskTx(txin.prevout, txPrev) || txin.prevout.n >= txPrev.vout.size())
+                    {
+                        txdb.BatchAbort();
+                        return error("RebuildOwnerIndex() : prev tx %s not found", txin.prevout.hash.ToString().substr(0,6).c_str());
+                    }
+                    if (ExtractOwnerHash160(txPrev.vout[txin.prevout.n].scriptPubKey, hash160))
+                    {
+                        txdb.AddOwnerTx(hash160, posThisTx, i);
+                        nEntries++;
+                    }
+                }
+            }
+        }
+        if (!txdb.BatchCommit())
+            return error("RebuildOwnerIndex() : BatchCommit failed");
+    }
+    printf("RebuildOwnerIndex() : %d entries for %d blocks\n", nEntries, vMainChain.size());
+    return true;
+}
+
 
 
 void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -1583,6 +2649,198 @@ void PrintBlockTree()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers first sync
+//
+// Peers send the header chain from a CBlockLocator, we check its proof of
+// work, then fetch the blocks from every peer that has them, a window at a
+// time past pindexBest.  All of it is under cs_main.
+//
+
+CBlockIndex* LookupBlockOrHeader(const uint256& hash)
+{
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return (*mi).second;
+    return NULL;
+}
+
+CBlockIndex* GetBestHeader()
+{
+    if (pindexBestHeader && (!pindexBest || pindexBestHeader->nChainWork > pindexBest->nChainWork))
+        return pindexBestHeader;
+    return pindexBest;
+}
+
+bool IsHeaderFailed(const uint256& hash)
+{
+    // A block's failure is only held against its header for a while, in
+    // case we got it wrong
+    map<uint256, int64>::iterator mi = mapHeaderFailed.find(hash);
+    if (mi == mapHeaderFailed.end())
+        return false;
+    if (GetTime() < (*mi).second)
+        return true;
+    mapHeaderFailed.erase(mi);
+    return false;
+}
+
+bool AcceptBlockHeader(CBlock& block, CBlockIndex*& pindexRet)
+{
+    uint256 hash = block.GetHash();
+    pindexRet = LookupBlockOrHeader(hash);
+    if (pindexRet)
+        return true;
+    if (IsHeaderFailed(hash) || IsHeaderFailed(block.hashPrevBlock))
+        return error("AcceptBlockHeader() : %s is on a chain whose block failed", hash.ToString().substr(0,14).c_str());
+    CBlockIndex* pindexPrev = LookupBlockOrHeader(block.hashPrevBlock);
+    if (!pindexPrev)
+        return error("AcceptBlockHeader() : prev block not found");
+
+    // The checks from CheckBlock and AcceptBlock that don't need the transactions
+    if (block.nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (CBigNum().SetCompact(block.nBits) > bnProofOfWorkLimit)
+        return error("AcceptBlockHeader() : nBits below minimum work");
+    if (hash > CBigNum().SetCompact(block.nBits).getuint256())
+        return error("AcceptBlockHeader() : hash doesn't match nBits");
+    if (block.nTime <= pindexPrev->GetMedianTimePast())
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+    if (block.nBits != GetNextWorkRequired(pindexPrev))
+        return error("AcceptBlockHeader() : incorrect proof of work");
+
+    CBlockIndex* pindexNew = new CBlockIndex(-1, 0, block);
+    CBlockIndexMap::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = pindexPrev->nHeight + 1;
+    pindexNew->BuildSkip();
+    pindexNew->CacheChainValues();
+
+    if (pindexNew->nChainWork > GetBestHeader()->nChainWork)
+        pindexBestHeader = pindexNew;
+    pindexRet = pindexNew;
+    return true;
+}
+
+void ClearHeaderIndex()
+{
+    for (CBlockIndexMap::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+        delete (*mi).second;
+    mapHeaderIndex.clear();
+    pindexBestHeader = NULL;
+}
+
+void PruneHeaderIndex()
+{
+    // Once the block chain has the work of the best header, every header
+    // entry is either downloaded or on a weaker branch we won't fetch.
+    // Nodes keep hashes, not pointers, so nothing else refers to them.
+    if (pindexBestHeader && pindexBest->nChainWork >= pindexBestHeader->nChainWork)
+        ClearHeaderIndex();
+}
+
+void UpdateBlockAvailability(CNode* pnode, const uint256& hash)
+{
+    CBlockIndex* pindex = LookupBlockOrHeader(hash);
+    if (!pindex)
+        return;
+    CBlockIndex* pindexKnown = LookupBlockOrHeader(pnode->hashBestKnownBlock);
+    if (!pindexKnown || pindex->nChainWork > pindexKnown->nChainWork)
+        pnode->hashBestKnownBlock = hash;
+}
+
+void FindNextBlocksToDownload(CNode* pto, unsigned int nCount, vector<CBlockIndex*>& vBlocks)
+{
+    CBlockIndex* pindexTarget = LookupBlockOrHeader(pto->hashBestKnownBlock);
+    if (!pindexTarget || pindexTarget->nChainWork <= pindexBest->nChainWork)
+        return;
+
+    // Find the fork by hash, header entries stand in for blocks we
+    // downloaded since so the pointers can differ
+    CBlockIndex* pindexWalk = pindexTarget->GetAncestor(min(pindexBest->nHeight, pindexTarget->nHeight));
+    CBlockIndex* pindexOurs = pindexBest->GetAncestor(pindexWalk->nHeight);
+    while (pindexWalk && pindexOurs && pindexWalk->GetBlockHash() != pindexOurs->GetBlockHash())
+    {
+        pindexWalk = pindexWalk->pprev;
+        pindexOurs = pindexOurs->pprev;
+    }
+    if (!pindexWalk)
+        return;
+
+    // Nothing past the window is asked for, so out of order blocks never
+    // fill the orphan pool with more than a window's worth
+    int nWindowEnd = min(pindexTarget->nHeight, pindexBest->nHeight + BLOCK_DOWNLOAD_WINDOW);
+    int nHeight = pindexWalk->nHeight;
+    vector<CBlockIndex*> vToFetch;
+    while (nHeight < nWindowEnd && vBlocks.size() < nCount)
+    {
+        // Collect the next stretch walking back from its top
+        int nToFetch = min(nWindowEnd - nHeight, 128);
+        vToFetch.resize(nToFetch);
+        CBlockIndex* pindex = pindexTarget->GetAncestor(nHeight + nToFetch);
+        for (int i = nToFetch - 1; i >= 0; i--, pindex = pindex->pprev)
+            vToFetch[i] = pindex;
+        nHeight += nToFetch;
+
+        foreach(CBlockIndex* pindexFetch, vToFetch)
+        {
+            uint256 hash = pindexFetch->GetBlockHash();
+            if (IsHeaderFailed(hash))
+                return;
+            if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+                continue;
+            // Being fetched off an inv
+            if (AskForInFlight(CInv(MSG_BLOCK, hash)))
+                continue;
+            vBlocks.push_back(pindexFetch);
+            if (vBlocks.size() == nCount)
+                break;
+        }
+    }
+}
+
+void CheckBlockDownloads()
+{
+    // Take blocks back from peers that went away or stopped delivering,
+    // the next peer that has them gets them.  Disconnected nodes aren't
+    // deleted for a few minutes but they're only looked at while in vNodes.
+    int64 nNow = GetTime();
+    set<CNode*> setNodes;
+    CRITICAL_BLOCK(cs_vNodes)
+        foreach(CNode* pnode, vNodes)
+            if (!pnode->fDisconnect)
+                setNodes.insert(pnode);
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+    {
+        CNode* pnode = (*mi).second.first;
+        if (setNodes.count(pnode))
+        {
+            if (nNow - max((*mi).second.second, pnode->nTimeLastBlock) < BLOCK_STALL_TIMEOUT)
+            {
+                mi++;
+                continue;
+            }
+            printf("block %s stalled on %s, reassigning\n", (*mi).first.ToString().substr(0,14).c_str(), pnode->addr.ToString().c_str());
+            pnode->nTimeBlockStall = nNow;
+        }
+        mapPartialBlocks.erase((*mi).first);
+        mapBlocksInFlight.erase(mi++);
+    }
+}
+
+
+
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Messages
@@ -1594,7 +2852,7 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
     switch (inv.type)
     {
     case MSG_TX:        return mapTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK:     return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    case MSG_BLOCK:     return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash) || mapBlocksInFlight.count(inv.hash);
     case MSG_REVIEW:    return true;
     case MSG_PRODUCT:   return mapProducts.count(inv.hash);
     }
@@ -1608,13 +2866,86 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
-bool ProcessMessages(CNode* pfrom)
+//
+// Recently requested blocks kept as ready to send "block" messages, full
+// and header only, so peers asking for the same new block share one buffer
+//
+typedef pair<uint256, bool> CBlockMessageKey;
+list<pair<CBlockMessageKey, CSendBufferRef> > listBlockMessageCache;
+map<CBlockMessageKey, list<pair<CBlockMessageKey, CSendBufferRef> >::iterator> mapBlockMessageCache;
+CCriticalSection cs_mapBlockMessageCache;
+int64 nBlockMessageCacheBytes = 0;
+int64 nBlockMessageCacheSize = 32 * 1024 * 1024;
+int64 nBlockMessageCacheHits = 0;
+int64 nBlockMessageCacheMisses = 0;
+
+void AddBlockMessage(const CBlock& block, bool fHeaderOnly)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
-    printf("ProcessMessages(%d bytes)\n", vRecv.size());
+    // Block serialization doesn't depend on the stream version, only on
+    // whether the transactions are left out
+    CDataStream ss(SER_NETWORK | (fHeaderOnly ? SER_BLOCKHEADERONLY : 0));
+    ss.reserve(fHeaderOnly ? 80 : 10000);
+    ss << block;
+    CSendBufferRef pbuf = MakeMessageBuffer("block", ss);
+
+    CBlockMessageKey key(block.GetHash(), fHeaderOnly);
+    CRITICAL_BLOCK(cs_mapBlockMessageCache)
+    {
+        if (mapBlockMessageCache.count(key))
+            return;
+        listBlockMessageCache.push_front(make_pair(key, pbuf));
+        mapBlockMessageCache[key] = listBlockMessageCache.begin();
+        nBlockMessageCacheBytes += pbuf->size();
+
+        // Evict least recently used
+        while (nBlockMessageCacheBytes > nBlockMessageCacheSize && listBlockMessageCache.size() > 1)
+        {
+            nBlockMessageCacheBytes -= listBlockMessageCache.back().second->size();
+            mapBlockMessageCache.erase(listBlockMessageCache.back().first);
+            listBlockMessageCache.pop_back();
+        }
+    }
+}
+
+CSendBufferRef GetBlockMessage(const uint256& hash, bool fHeaderOnly)
+{
+    CBlockMessageKey key(hash, fHeaderOnly);
+    CRITICAL_BLOCK(cs_mapBlockMessageCache)
+    {
+        map<CBlockMessageKey, list<pair<CBlockMessageKey, CSendBufferRef> >::iterator>::iterator mi = mapBlockMessageCache.find(key);
+        if (mi != mapBlockMessageCache.end())
+        {
+            nBlockMessageCacheHits++;
+            listBlockMessageCache.splice(listBlockMessageCache.begin(), listBlockMessageCache, (*mi).second);
+            return (*(*mi).second).second;
+        }
+        nBlockMessageCacheMisses++;
+    }
+
+    // Read it from disk once for everyone who asks after, cs_main is held
+    // for mapBlockIndex
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return CSendBufferRef();
+    CBlock block;
+    if (!block.ReadFromDisk((*mi).second, !fHeaderOnly))
+        return CSendBufferRef();
+    AddBlockMessage(block, fHeaderOnly);
+
+    CRITICAL_BLOCK(cs_mapBlockMessageCache)
+    {
+        map<CBlockMessageKey, list<pair<CBlockMessageKey, CSendBufferRef> >::iterator>::iterator mi = mapBlockMessageCache.find(key);
+        if (mi != mapBlockMessageCache.end())
+            return (*(*mi).second).second;
+    }
+    return CSendBufferRef();
+}
+
+// When each recently received block's last byte arrived, guarded by cs_main
+map<uint256, int64> mapBlockRelayStart;
 
+bool ProcessMessages(CNode* pfrom)
+{
     //
     // Message format
     //  (4) message start
@@ -1622,71 +2953,184 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) size
     //  (x) data
     //
+    // The socket handler frames messages into vRecvMsg as bytes arrive
+    //
+    deque<CNetMessage>& vRecvMsg = pfrom->vRecvMsg;
 
-    loop
+    // Give up waiting for a message that isn't going to finish, an overlong
+    // size in a bad header would otherwise swallow everything after it
+    if (!vRecvMsg.empty() && !vRecvMsg.back().IsComplete())
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        if (vRecv.end() - pstart < sizeof(CMessageHeader))
+        CNetMessage& msg = vRecvMsg.back();
+        if (pfrom->fDisconnect || GetTime() - msg.nTimeStart > RECV_MESSAGE_TIMEOUT)
         {
-            if (vRecv.size() > sizeof(CMessageHeader))
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - sizeof(CMessageHeader));
-            }
-            break;
+            if (msg.fInData)
+                printf("ProcessMessages() : gave up on %s after %u of %u bytes\n", msg.hdr.GetCommand().c_str(), msg.nDataPos, msg.hdr.nMessageSize);
+            vRecvMsg.pop_back();
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
+    }
 
-        // Read header
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
+    while (!vRecvMsg.empty() && vRecvMsg.front().IsComplete())
+    {
+        // The worker checks for shutdown itself, it knows its thread slot
+        if (fShutdown)
+            return true;
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > vRecv.size())
+        CNetMessage& msg = vRecvMsg.front();
+        string strCommand = msg.hdr.GetCommand();
+        unsigned int nMessageSize = msg.hdr.nMessageSize;
+        CDataStream& vMsg = msg.vRecv;
+        vMsg.SetType(pfrom->nRecvType);
+        vMsg.SetVersion(pfrom->nRecvVersion);
+
+        // Time spent waiting between the last byte arriving and processing
+        pfrom->nTimeMessageComplete = msg.nTimeComplete;
+        int64 nQueueMicros = GetTimeMicros() - msg.nTimeComplete;
+        CRITICAL_BLOCK(cs_netStats)
         {
-            // Rewind and wait for rest of message
-            ///// need a mechanism to give up waiting for overlong message size error
-            printf("MESSAGE-BREAK 2\n");
-            vRecv.insert(vRecv.begin(), BEGIN(hdr), END(hdr));
-            Sleep(100);
-            break;
+            nMessageQueueCount++;
+            nMessageQueueMicros += nQueueMicros;
+            nMessageQueueMicrosMax = max(nMessageQueueMicrosMax, nQueueMicros);
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
         try
         {
-            CheckForShutdown(2);
-            CRITICAL_BLOCK(cs_main)
+            if (strCommand == "tx" || strCommand == "block" || strCommand == "cmpctblock" || strCommand == "blocktxn")
+            {
+                // These take cs_main themselves after their context free checks
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
-            CheckForShutdown(2);
+            }
+            else
+            {
+                CRITICAL_BLOCK(cs_main)
+                    fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            }
         }
         CATCH_PRINT_EXCEPTION("ProcessMessage()")
         if (!fRet)
             printf("ProcessMessage(%s, %d bytes) from %s to %s FAILED\n", strCommand.c_str(), nMessageSize, pfrom->addr.ToString().c_str(), addrLocalHost.ToString().c_str());
+
+        vRecvMsg.pop_front();
     }
 
-    vRecv.Compact();
     return true;
 }
 
 
 
 
+static void HeaderBlockFailed(const uint256& hash)
+{
+    // CheckBlock passed, so the transactions are the ones the header
+    // commits to and its header chain is no good past here.  Start
+    // the headers over.
+    printf("block %s from the header chain failed, dropping headers\n", hash.ToString().substr(0,14).c_str());
+    mapHeaderFailed[hash] = GetTime() + HEADER_FAILED_EXPIRE;
+    ClearHeaderIndex();
+}
+
+bool ReceiveBlock(CNode* pfrom, CBlock* pblockIn)
+{
+    // Called without cs_main, takes ownership of pblockIn
+    auto_ptr<CBlock> pblock(pblockIn);
+
+    //// debug print
+    printf("received block:\n"); pblock->print();
+
+    CInv inv(MSG_BLOCK, pblock->GetHash());
+    pfrom->AddInventoryKnown(inv);
+    AskForReceived(pfrom, inv);
+
+    // Context free checks and the signatures we can already see.  Neither
+    // touches anything local that could fail.
+    bool fCheckBlock = pblock->CheckBlock();
+    bool fPreChecked = fCheckBlock && PreCheckBlockSignatures(*pblock);
+    if (!fCheckBlock)
+        error("ReceiveBlock() : CheckBlock FAILED");
+    else if (!fPreChecked)
+        error("ReceiveBlock() : block %s failed signature precheck", inv.hash.ToString().substr(0,14).c_str());
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        mapBlocksInFlight.erase(inv.hash);
+        mapPartialBlocks.erase(inv.hash);
+        if (!fPreChecked)
+        {
+            // A block failing CheckBlock may not be the one the header
+            // commits to, only a bad signature condemns the header
+            if (fCheckBlock && mapHeaderIndex.count(inv.hash))
+                HeaderBlockFailed(inv.hash);
+            return false;
+        }
+        pfrom->nTimeLastBlock = GetTime();
+        UpdateBlockAvailability(pfrom, inv.hash);
+
+        bool fDuplicate = (mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash));
+        fBlockLocalError = false;
+        bool fProcessed = ProcessBlock(pfrom, pblock.release(), true);
+        if (!fProcessed && !fDuplicate && !fBlockLocalError && mapHeaderIndex.count(inv.hash))
+            HeaderBlockFailed(inv.hash);
+        PruneHeaderIndex();
+
+        if (fProcessed)
+        {
+            AskForDone(inv);
+
+            // Remember when it came in to time how long it takes to pass on
+            int64 nNow = GetTimeMicros();
+            for (map<uint256, int64>::iterator mi = mapBlockRelayStart.begin(); mi != mapBlockRelayStart.end();)
+            {
+                if (nNow - (*mi).second > (int64)10 * 60 * 1000000)
+                    mapBlockRelayStart.erase(mi++);
+                else
+                    mi++;
+            }
+            mapBlockRelayStart[inv.hash] = pfrom->nTimeMessageComplete;
+        }
+    }
+    return true;
+}
+
+void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    // Compact block didn't work out, under cs_main
+    nCompactBlocksFailed++;
+    mapPartialBlocks.erase(hash);
+    mapBlocksInFlight[hash] = make_pair(pfrom, GetTime());
+    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+}
+
+bool FillCompactBlock(const CCompactBlock& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    // Match short IDs against the memory pool, under cs_main.  An ID two
+    // pool transactions share counts as missing.
+    uint256 hashKey = cmpctblock.GetShortIDKey();
+    map<uint64, const CTransaction*> mapShortID;
+    block = cmpctblock.header;
+    block.vtx.resize(1 + cmpctblock.GetShortIDCount());
+    block.vtx[0] = cmpctblock.txCoinBase;
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        {
+            pair<map<uint64, const CTransaction*>::iterator, bool> ret = mapShortID.insert(make_pair(CCompactBlock::GetShortID(hashKey, (*mi).first), &(*mi).second));
+            if (!ret.second)
+                (*ret.first).second = NULL;
+        }
+        for (unsigned int i = 0; i < cmpctblock.GetShortIDCount(); i++)
+        {
+            map<uint64, const CTransaction*>::iterator mi = mapShortID.find(cmpctblock.GetShortID(i));
+            if (mi != mapShortID.end() && (*mi).second)
+                block.vtx[i + 1] = *(*mi).second;
+            else
+                vMissing.push_back(i + 1);
+        }
+    }
+    return vMissing.empty();
+}
+
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
@@ -1715,25 +3159,33 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return false;
 
         pfrom->vSend.SetVersion(min(pfrom->nVersion, VERSION));
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+        pfrom->nRecvVersion = min(pfrom->nVersion, VERSION);
 
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
         if (pfrom->fClient)
         {
             pfrom->vSend.nType |= SER_BLOCKHEADERONLY;
-            pfrom->vRecv.nType |= SER_BLOCKHEADERONLY;
+            pfrom->nRecvType |= SER_BLOCKHEADERONLY;
         }
 
         AddTimeData(pfrom->addr.ip, nTime);
 
-        // Ask the first connected node for block updates
-        static bool fAskedForBlocks;
-        if (!fAskedForBlocks && !pfrom->fClient)
+        // Ask for headers from a block back, so a peer at the same height
+        // still answers with its tip.  Peers that don't know getheaders get
+        // getblocks from SendMessages after a while.
+        if (!pfrom->fClient)
         {
-            fAskedForBlocks = true;
-            pfrom->PushMessage("getblocks", CBlockLocator(pindexBest), uint256(0));
+            CBlockIndex* pindexStart = GetBestHeader();
+            if (pindexStart->pprev)
+                pindexStart = pindexStart->pprev;
+            pfrom->nTimeGetHeaders = GetTime();
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexStart), uint256(0));
         }
 
+        // Offer to take new blocks as cmpctblock, old peers ignore it
+        if (!pfrom->fClient)
+            pfrom->PushMessage("sendcmpct");
+
         printf("version addrMe = %s\n", addrMe.ToString().c_str());
     }
 
@@ -1759,10 +3211,11 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (AddAddress(addrdb, addr))
             {
                 // Put on lists to send to other nodes
-                pfrom->setAddrKnown.insert(addr);
+                vector<unsigned char> vchKey = addr.GetKey();
+                pfrom->filterAddrKnown.insert(vchKey);
                 CRITICAL_BLOCK(cs_vNodes)
                     foreach(CNode* pnode, vNodes)
-                        if (!pnode->setAddrKnown.count(addr))
+                        if (!pnode->filterAddrKnown.contains(vchKey))
                             pnode->vAddrToSend.push_back(addr);
             }
         }
@@ -1784,6 +3237,15 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK)
+            {
+                // Learn what they have, or the headers leading to it
+                if (LookupBlockOrHeader(inv.hash))
+                    UpdateBlockAvailability(pfrom, inv.hash);
+                else if (pfrom->fHaveHeaders)
+                    pfrom->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+            }
+
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
@@ -1806,23 +3268,19 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    //// could optimize this to send header straight from blockindex for client
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second, !pfrom->fClient);
-                    pfrom->PushMessage("block", block);
-                }
+                // Send block from the serialized message cache, or from disk
+                CSendBufferRef pbuf = GetBlockMessage(inv.hash, (pfrom->vSend.nType & SER_BLOCKHEADERONLY) != 0);
+                if (pbuf)
+                    pfrom->PushBuffer(pbuf);
             }
             else if (inv.IsKnownType())
             {
                 // Send stream from relay memory
                 CRITICAL_BLOCK(cs_mapRelay)
                 {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSendBufferRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushBuffer((*mi).second);
                 }
             }
         }
@@ -1839,34 +3297,88 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CBlockIndex* pindex = locator.GetBlockIndex();
 
         // Send the rest of the chain
-        if (pindex)
-            pindex = pindex->pnext;
-        printf("getblocks %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,14).c_str());
-        for (; pindex; pindex = pindex->pnext)
+        unsigned int nHeight = (pindex ? pindex->nHeight + 1 : vMainChain.size());
+        printf("getblocks %d to %s\n", (nHeight < vMainChain.size() ? nHeight : -1), hashStop.ToString().substr(0,14).c_str());
+        for (; nHeight < vMainChain.size(); nHeight++)
         {
+            pindex = vMainChain[nHeight];
             if (pindex->GetBlockHash() == hashStop)
             {
                 printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,14).c_str());
                 break;
             }
 
-            // Bypass setInventoryKnown in case an inventory message got lost
+            // Bypass filterInventoryKnown in case an inventory message got lost
             CRITICAL_BLOCK(pfrom->cs_inventory)
-            {
-                CInv inv(MSG_BLOCK, pindex->GetBlockHash());
-                // returns true if wasn't already contained in the set
-                if (pfrom->setInventoryKnown2.insert(inv).second)
-                {
-                    pfrom->setInventoryKnown.erase(inv);
-                    pfrom->vInventoryToSend.push_back(inv);
-                }
-            }
+                pfrom->vInventoryResend.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        }
+    }
+
+
+    else if (strCommand == "getheaders")
+    {
+        CBlockLocator locator;
+        uint256 hashStop;
+        vRecv >> locator >> hashStop;
+
+        // Find the first block the caller has in the main chain
+        CBlockIndex* pindex = locator.GetBlockIndex();
+
+        // Send headers for the rest of the chain
+        vector<CBlock> vHeaders;
+        unsigned int nHeight = (pindex ? pindex->nHeight + 1 : vMainChain.size());
+        for (; nHeight < vMainChain.size() && vHeaders.size() < MAX_HEADERS_RESULTS; nHeight++)
+        {
+            pindex = vMainChain[nHeight];
+            vHeaders.push_back(pindex->GetBlockHeader());
+            if (pindex->GetBlockHash() == hashStop)
+                break;
+        }
+        printf("getheaders sending %d headers\n", vHeaders.size());
+
+        // Header only whatever the peer is, the way clients get blocks
+        CDataStream ssHeaders(SER_NETWORK | SER_BLOCKHEADERONLY);
+        ssHeaders << vHeaders;
+        pfrom->PushMessage("headers", ssHeaders);
+    }
+
+
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv.nType |= SER_BLOCKHEADERONLY;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+            return error("ProcessMessage() : headers message size %d", vHeaders.size());
+        pfrom->fHaveHeaders = true;
+        pfrom->nTimeGetHeaders = 0;
+
+        CBlockIndex* pindexLast = NULL;
+        foreach(CBlock& block, vHeaders)
+        {
+            if (fShutdown)
+                return true;
+            if (pindexLast && block.hashPrevBlock != pindexLast->GetBlockHash())
+                return error("ProcessMessage() : headers not in a chain");
+            if (!AcceptBlockHeader(block, pindexLast))
+                return error("ProcessMessage() : AcceptBlockHeader FAILED");
+        }
+        printf("received %d headers, best header now %d\n", vHeaders.size(), GetBestHeader()->nHeight);
+
+        if (pindexLast)
+        {
+            UpdateBlockAvailability(pfrom, pindexLast->GetBlockHash());
+
+            // A full message means they have more
+            if (vHeaders.size() == MAX_HEADERS_RESULTS)
+                pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
         }
     }
 
 
     else if (strCommand == "tx")
     {
+        // Called without cs_main
         vector<uint256> vWorkQueue;
         CDataStream vMsg(vRecv);
         CTransaction tx;
@@ -1874,46 +3386,54 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
+        AskForReceived(pfrom, inv);
 
-        bool fMissingInputs = false;
-        if (tx.AcceptTransaction(true, &fMissingInputs))
-        {
-            AddToWalletIfMine(tx, NULL);
-            RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
+        // Context free checks and the signatures we can already see
+        if (!PreCheckTransaction(tx))
+            return error("ProcessMessage() : tx %s failed precheck", inv.hash.ToString().substr(0,6).c_str());
 
-            // Recursively process any orphan transactions that depended on this one
-            for (int i = 0; i < vWorkQueue.size(); i++)
+        CRITICAL_BLOCK(cs_main)
+        {
+            bool fMissingInputs = false;
+            if (tx.AcceptTransaction(true, &fMissingInputs))
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
-                     mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
+                AddToWalletIfMine(tx, NULL);
+                RelayMessage(inv, vMsg);
+                AskForDone(inv);
+                vWorkQueue.push_back(inv.hash);
 
-                    if (tx.AcceptTransaction(true))
+                // Recursively process any orphan transactions that depended on this one
+                for (int i = 0; i < vWorkQueue.size(); i++)
+                {
+                    uint256 hashPrev = vWorkQueue[i];
+                    for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
+                         mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
+                         ++mi)
                     {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,6).c_str());
-                        AddToWalletIfMine(tx, NULL);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
+                        const CDataStream& vMsg = *((*mi).second);
+                        CTransaction tx;
+                        CDataStream(vMsg) >> tx;
+                        CInv inv(MSG_TX, tx.GetHash());
+
+                        if (tx.AcceptTransaction(true))
+                        {
+                            printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,6).c_str());
+                            AddToWalletIfMine(tx, NULL);
+                            RelayMessage(inv, vMsg);
+                            AskForDone(inv);
+                            vWorkQueue.push_back(inv.hash);
+                        }
                     }
                 }
-            }
 
-            foreach(uint256 hash, vWorkQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,6).c_str());
-            AddOrphanTx(vMsg);
+                foreach(uint256 hash, vWorkQueue)
+                    EraseOrphanTx(hash);
+            }
+            else if (fMissingInputs)
+            {
+                printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,6).c_str());
+                AddOrphanTx(vMsg);
+            }
         }
     }
 
@@ -1926,29 +3446,163 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_REVIEW, review.GetHash());
         pfrom->AddInventoryKnown(inv);
+        AskForReceived(pfrom, inv);
 
         if (review.AcceptReview())
         {
             // Relay the original message as-is in case it's a higher version than we know how to parse
             RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
+            AskForDone(inv);
         }
     }
 
 
     else if (strCommand == "block")
     {
+        // Called without cs_main
         auto_ptr<CBlock> pblock(new CBlock);
         vRecv >> *pblock;
+        return ReceiveBlock(pfrom, pblock.release());
+    }
 
-        //// debug print
-        printf("received block:\n"); pblock->print();
 
-        CInv inv(MSG_BLOCK, pblock->GetHash());
+    else if (strCommand == "sendcmpct")
+    {
+        pfrom->fSendCompact = true;
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        // Called without cs_main
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
 
-        if (ProcessBlock(pfrom, pblock.release()))
-            mapAlreadyAskedFor.erase(inv);
+        // A transaction is at least 60 bytes, don't make room for more
+        // than a block could hold
+        if (cmpctblock.vchShortIDs.size() % CCompactBlock::SHORTID_SIZE != 0 || cmpctblock.GetShortIDCount() > MAX_SIZE / 60)
+            return error("ProcessMessage() : cmpctblock %s bad short ID list", hash.ToString().substr(0,14).c_str());
+
+        auto_ptr<CBlock> pblock(new CBlock);
+        CRITICAL_BLOCK(cs_main)
+        {
+            nCompactBlocksReceived++;
+            if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapPartialBlocks.count(hash))
+                return true;
+
+            // The header's proof of work first, so nobody gets us matching
+            // short IDs for free.  If it doesn't go on our best block the
+            // header chain fetches it the usual way.
+            CBlockIndex* pindex;
+            if (!AcceptBlockHeader(cmpctblock.header, pindex))
+            {
+                if (!LookupBlockOrHeader(cmpctblock.header.hashPrevBlock))
+                    pfrom->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+                return error("ProcessMessage() : cmpctblock %s header rejected", hash.ToString().substr(0,14).c_str());
+            }
+            UpdateBlockAvailability(pfrom, hash);
+            if (cmpctblock.header.hashPrevBlock != hashBestChain || mapBlocksInFlight.count(hash))
+                return true;
+
+            vector<unsigned int> vMissing;
+            if (!FillCompactBlock(cmpctblock, *pblock, vMissing))
+            {
+                printf("cmpctblock %s missing %d of %d transactions\n", hash.ToString().substr(0,14).c_str(), vMissing.size(), pblock->vtx.size());
+                nCompactBlocksTxRequested++;
+                CPartialBlock& partial = mapPartialBlocks[hash];
+                partial.pfrom = pfrom;
+                partial.nTime = GetTime();
+                partial.block = *pblock;
+                mapBlocksInFlight[hash] = make_pair(pfrom, GetTime());
+                pfrom->PushMessage("getblocktxn", hash, vMissing);
+                return true;
+            }
+            if (pblock->BuildMerkleTree() != pblock->hashMerkleRoot)
+            {
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
+        }
+        return ReceiveBlock(pfrom, pblock.release());
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hash;
+        vector<unsigned int> vIndexes;
+        vRecv >> hash >> vIndexes;
+
+        // Nearly always the block we just announced, others are read
+        CBlock blockRead;
+        const CBlock& block = (hash == hashCompactBlock ? blockCompact : blockRead);
+        if (hash != hashCompactBlock)
+        {
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi == mapBlockIndex.end())
+                return error("ProcessMessage() : getblocktxn for unknown block %s", hash.ToString().substr(0,14).c_str());
+            if (!blockRead.ReadFromDisk((*mi).second, true))
+                return error("ProcessMessage() : getblocktxn ReadFromDisk failed");
+        }
+
+        // Indexes must be strictly increasing and in range, so the reply can
+        // never be larger than the block itself
+        if (vIndexes.size() > block.vtx.size())
+        {
+            pfrom->fDisconnect = true;
+            return error("ProcessMessage() : getblocktxn requested %d of %d transactions", vIndexes.size(), block.vtx.size());
+        }
+        vector<CTransaction> vtx;
+        vtx.reserve(vIndexes.size());
+        for (int i = 0; i < vIndexes.size(); i++)
+        {
+            unsigned int n = vIndexes[i];
+            if (n >= block.vtx.size() || (i > 0 && n <= vIndexes[i-1]))
+            {
+                pfrom->fDisconnect = true;
+                return error("ProcessMessage() : getblocktxn bad index %u", n);
+            }
+            vtx.push_back(block.vtx[n]);
+        }
+        pfrom->PushMessage("blocktxn", hash, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        // Called without cs_main
+        uint256 hash;
+        vector<CTransaction> vtx;
+        vRecv >> hash >> vtx;
+
+        auto_ptr<CBlock> pblock(new CBlock);
+        CRITICAL_BLOCK(cs_main)
+        {
+            map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hash);
+            if (mi == mapPartialBlocks.end() || (*mi).second.pfrom != pfrom)
+                return error("ProcessMessage() : blocktxn for %s not asked for", hash.ToString().substr(0,14).c_str());
+            *pblock = (*mi).second.block;
+            mapPartialBlocks.erase(mi);
+
+            // Fill the gaps in order
+            unsigned int n = 0;
+            foreach(CTransaction& tx, pblock->vtx)
+                if (tx.IsNull() && n < vtx.size())
+                    tx = vtx[n++];
+            bool fComplete = (n == vtx.size());
+            foreach(const CTransaction& tx, pblock->vtx)
+                if (tx.IsNull())
+                    fComplete = false;
+            if (!fComplete || pblock->BuildMerkleTree() != pblock->hashMerkleRoot)
+            {
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
+        }
+        return ReceiveBlock(pfrom, pblock.release());
     }
 
 
@@ -2055,7 +3709,8 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool SendMessages(CNode* pto)
 {
-    CheckForShutdown(2);
+    if (fShutdown)
+        return true;
     CRITICAL_BLOCK(cs_main)
     {
         // Don't send anything until we get their version message
@@ -2069,7 +3724,7 @@ bool SendMessages(CNode* pto)
         vector<CAddress> vAddrToSend;
         vAddrToSend.reserve(pto->vAddrToSend.size());
         foreach(const CAddress& addr, pto->vAddrToSend)
-            if (!pto->setAddrKnown.count(addr))
+            if (!pto->filterAddrKnown.contains(addr.GetKey()))
                 vAddrToSend.push_back(addr);
         pto->vAddrToSend.clear();
         if (!vAddrToSend.empty())
@@ -2082,37 +3737,123 @@ bool SendMessages(CNode* pto)
         vector<CInv> vInventoryToSend;
         CRITICAL_BLOCK(pto->cs_inventory)
         {
-            vInventoryToSend.reserve(pto->vInventoryToSend.size());
+            // Resends go out even if they should know them, once each and
+            // in the order queued, which for getblocks is chain order
+            set<uint256> setResent;
+            vInventoryToSend.reserve(pto->vInventoryResend.size() + pto->vInventoryToSend.size());
+            foreach(const CInv& inv, pto->vInventoryResend)
+            {
+                if (!setResent.insert(inv.hash).second)
+                    continue;
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInventoryToSend.push_back(inv);
+            }
             foreach(const CInv& inv, pto->vInventoryToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (!pto->filterInventoryKnown.contains(inv.hash))
+                {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInventoryToSend.push_back(inv);
+                }
             }
             pto->vInventoryToSend.clear();
-            pto->setInventoryKnown2.clear();
+            pto->vInventoryResend.clear();
+        }
+        // Peers that asked for compact blocks get the new best block as one
+        vector<CInv> vInv;
+        vInv.reserve(vInventoryToSend.size());
+        foreach(const CInv& inv, vInventoryToSend)
+        {
+            if (inv.type == MSG_BLOCK && inv.hash == hashCompactBlock && pto->fSendCompact && !pto->fClient)
+                pto->PushBuffer(pbufCompactBlock);
+            else
+                vInv.push_back(inv);
+        }
+        if (!vInv.empty())
+            pto->PushMessage("inv", vInv);
+
+        // Per hop block relay latency, from the block's last byte arriving to
+        // its inv being queued for this peer
+        int64 nNowMicros = GetTimeMicros();
+        foreach(const CInv& inv, vInventoryToSend)
+        {
+            if (inv.type != MSG_BLOCK)
+                continue;
+            map<uint256, int64>::iterator mi = mapBlockRelayStart.find(inv.hash);
+            if (mi == mapBlockRelayStart.end())
+                continue;
+            int64 nMicros = nNowMicros - (*mi).second;
+            nBlockRelayCount++;
+            nBlockRelayMicros += nMicros;
+            nBlockRelayMicrosMax = max(nBlockRelayMicrosMax, nMicros);
         }
-        if (!vInventoryToSend.empty())
-            pto->PushMessage("inv", vInventoryToSend);
 
 
         //
         // Message: getdata
         //
         vector<CInv> vAskFor;
-        int64 nNow = GetTime() * 1000000;
+        vector<pair<int64, CInv> > vAskLater;
+        int64 nNow = GetTimeMicros();
         CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow && pto->nAskForInFlight < MAX_ASKFOR_IN_FLIGHT)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            printf("sending getdata: %s\n", inv.ToString().c_str());
-            if (!AlreadyHave(txdb, inv))
-                vAskFor.push_back(inv);
+            CInv inv = (*pto->mapAskFor.begin()).second;
             pto->mapAskFor.erase(pto->mapAskFor.begin());
+            if (AlreadyHave(txdb, inv))
+                continue;
+            int64 nRetryTime;
+            if (AskForBegin(pto, inv, nRetryTime))
+            {
+                printf("sending getdata: %s\n", inv.ToString().c_str());
+                vAskFor.push_back(inv);
+            }
+            else if (nRetryTime)
+            {
+                vAskLater.push_back(make_pair(nRetryTime, inv));
+            }
+        }
+
+        // In flight from another peer, look again when that one times out
+        pto->mapAskFor.insert(vAskLater.begin(), vAskLater.end());
+
+        // Blocks off the header chain, up to MAX_BLOCKS_IN_FLIGHT at a time
+        // from each peer.  A peer that just stalled sits out for a while.
+        int64 nTimeNow = GetTime();
+        static int64 nLastDownloadCheck;
+        if (nTimeNow != nLastDownloadCheck)
+        {
+            nLastDownloadCheck = nTimeNow;
+            CheckBlockDownloads();
+            CheckAskForTimeouts();
+        }
+        if (!pto->fClient && nTimeNow - pto->nTimeBlockStall >= BLOCK_STALL_TIMEOUT)
+        {
+            int nInFlight = 0;
+            for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); ++mi)
+                if ((*mi).second.first == pto)
+                    nInFlight++;
+            vector<CBlockIndex*> vToFetch;
+            if (nInFlight < MAX_BLOCKS_IN_FLIGHT)
+                FindNextBlocksToDownload(pto, MAX_BLOCKS_IN_FLIGHT - nInFlight, vToFetch);
+            foreach(CBlockIndex* pindex, vToFetch)
+            {
+                CInv inv(MSG_BLOCK, pindex->GetBlockHash());
+                printf("sending getdata: %s at %d\n", inv.ToString().c_str(), pindex->nHeight);
+                vAskFor.push_back(inv);
+                mapBlocksInFlight[inv.hash] = make_pair(pto, nTimeNow);
+            }
         }
         if (!vAskFor.empty())
             pto->PushMessage("getdata", vAskFor);
 
+        // Peers that never answered getheaders are synced the old way
+        if (pto->nTimeGetHeaders && nTimeNow - pto->nTimeGetHeaders > 2 * 60)
+        {
+            pto->nTimeGetHeaders = 0;
+            pto->PushMessage("getblocks", CBlockLocator(pindexBest), uint256(0));
+        }
+
     }
     return true;
 }
@@ -2389,6 +4130,7 @@ int64 GetBalance()
     QueryPerformanceCounter((LARGE_INTEGER*)&nStart);
 
     int64 nTotal = 0;
+    CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(cs_mapWallet)
     {
         for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
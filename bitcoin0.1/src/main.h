@@ -11,13 +11,34 @@ class CTxOut;
 class CTransaction;
 class CBlock;
 class CBlockIndex;
+class CBlockIndexMap;
+class CBlockUndo;
 class CWalletTx;
 class CKeyItem;
 
 static const unsigned int MAX_SIZE = 0x02000000;
+static const int64 RECV_MESSAGE_TIMEOUT = 10 * 60;
+static const int MAX_HEADERS_RESULTS = 2000;
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_FLIGHT = 16;
+static const int64 BLOCK_STALL_TIMEOUT = 60;
+static const int64 HEADER_FAILED_EXPIRE = 6 * 60 * 60;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int COINBASE_MATURITY = 100;
+static const int UNDO_KEEP_DEPTH = 2000;
+
+// Format of block index records.  Kept apart from VERSION, which is also
+// what OP_VER pushes in scripts.  Records from 102 on carry nTx, from 103
+// on they don't have hashNext.
+static const int DISKINDEX_VERSION = 103;
+
+enum
+{
+    BLOCKFILESYNC_NONE,
+    BLOCKFILESYNC_BLOCK,
+    BLOCKFILESYNC_PERIODIC,
+};
 
 static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
@@ -27,12 +48,15 @@ static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
 
 extern CCriticalSection cs_main;
-extern map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
 extern const uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern vector<CBlockIndex*> vMainChain;
+extern CBlockIndex* pindexBestHeader;
+extern map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
 extern unsigned int nTransactionsUpdated;
 extern string strSetDataDir;
 extern int nDropMessagesTest;
@@ -41,6 +65,18 @@ extern int nDropMessagesTest;
 extern int fGenerateBitcoins;
 extern int64 nTransactionFee;
 extern CAddress addrIncoming;
+extern int nBlockFileSync;
+extern unsigned int nBlockFileMaxSize;
+extern unsigned int nBlockFilePrealloc;
+extern int nRescanThreads;
+extern int64 nBlockMessageCacheSize;
+extern int64 nBlockMessageCacheHits;
+extern int64 nBlockMessageCacheMisses;
+extern int64 nCompactBlocksReceived;
+extern int64 nCompactBlocksTxRequested;
+extern int64 nCompactBlocksFailed;
+extern int nRescanBlocksDone;
+extern int nRescanBlocksTotal;
 
 
 
@@ -50,15 +86,29 @@ extern CAddress addrIncoming;
 
 string GetAppDir();
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+bool AppendBlockFile(const CDataStream& ss, unsigned int& nFileRet, unsigned int& nPosRet);
+unsigned int GetBlockFileDataSize(unsigned int nFile, unsigned int nSize);
+void CloseBlockFile();
 bool AddKey(const CKey& key);
 vector<unsigned char> GenerateNewKey();
 bool AddToWallet(const CWalletTx& wtxIn);
 void ReacceptWalletTransactions();
 void RelayWalletTransactions();
 bool LoadBlockIndex(bool fAllowNew=true);
+bool RebuildOwnerIndex();
+bool ScanForWalletTransactions(int nStartHeight);
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb);
+CBlockIndex* GetBestHeader();
+void SetMainChain(CBlockIndex* pindexTip);
+unsigned int ReadBlockTxCount(unsigned int nFile, unsigned int nBlockPos);
 void PrintBlockTree();
 bool BitcoinMiner();
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked=false);
+bool VerifySignatureCached(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn);
+bool PreCheckTransaction(const CTransaction& tx, const map<uint256, const CTransaction*>* pmapBlockTx=NULL);
+bool PreCheckBlockSignatures(const CBlock& block);
+void AddBlockMessage(const CBlock& block, bool fHeaderOnly);
+CSendBufferRef GetBlockMessage(const uint256& hash, bool fHeaderOnly);
 bool ProcessMessages(CNode* pfrom);
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv);
 bool SendMessages(CNode* pto);
@@ -77,6 +127,39 @@ bool SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew);
 
 
 
+//
+// Reads from a read-only mapping of a block file, positioned at nPos.
+// The views are cached and shared, so reading a block or a transaction
+// doesn't open and close the file.  Test with ! in case the file
+// couldn't be mapped.
+//
+class CBlockFileView;
+
+class CBlockFileStream : public CMemoryStream
+{
+protected:
+    CBlockFileView* pview;
+
+public:
+    CBlockFileStream(unsigned int nFile, unsigned int nPos, int nTypeIn=SER_DISK, int nVersionIn=VERSION);
+    ~CBlockFileStream();
+    bool operator!() const { return (pview == NULL); }
+
+private:
+    CBlockFileStream(const CBlockFileStream&);
+    void operator=(const CBlockFileStream&);
+};
+
+
+
+
+
+
+
+
+
+
+
 class CDiskTxPos
 {
 public:
@@ -112,6 +195,15 @@ public:
         return !(a == b);
     }
 
+    friend bool operator<(const CDiskTxPos& a, const CDiskTxPos& b)
+    {
+        if (a.nFile != b.nFile)
+            return a.nFile < b.nFile;
+        if (a.nBlockPos != b.nBlockPos)
+            return a.nBlockPos < b.nBlockPos;
+        return a.nTxPos < b.nTxPos;
+    }
+
     string ToString() const
     {
         if (IsNull())
@@ -513,6 +605,16 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            CBlockFileStream filemap(pos.nFile, pos.nTxPos);
+            if (!!filemap)
+            {
+                filemap >> *this;
+                return true;
+            }
+        }
+
         CAutoFile filein = OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb");
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -570,8 +672,8 @@ public:
 
 
 
-    bool DisconnectInputs(CTxDB& txdb);
-    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+    bool DisconnectInputs(CTxDB& txdb, CDiskTxPos posThisTx, const map<uint256, const CTransaction*>& mapBlockTx);
+    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0, CBlockUndo* pundo=NULL);
     bool ClientConnectInputs();
 
     bool AcceptTransaction(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -642,6 +744,7 @@ public:
 
 
     int SetMerkleBranch(const CBlock* pblock=NULL);
+    // These read mapBlockIndex and vMainChain, the caller holds cs_main
     int GetDepthInMainChain() const;
     bool IsInMainChain() const { return GetDepthInMainChain() > 0; }
     int GetBlocksToMaturity() const;
@@ -716,7 +819,7 @@ public:
     }
 
 
-    int64 GetTxTime() const;
+    int64 GetTxTime() const;  // caller holds cs_main
 
     void AddSupportingTransactions(CTxDB& txdb);
 
@@ -791,6 +894,50 @@ public:
 
 
 
+//
+// What connecting a block changed in the tx index, written with it and
+// applied to take it back off without reading the block or the index
+// entries it spent from.
+//
+class CBlockUndo
+{
+public:
+    // Index entries of the transactions it spent from, as they were before
+    map<uint256, CTxIndex> mapPrevTxIndex;
+
+    // Transactions it added to the index
+    vector<uint256> vTxAdded;
+
+    // Owner index entries it added
+    vector<pair<uint160, CDiskTxPos> > vOwnerAdded;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(mapPrevTxIndex);
+        READWRITE(vTxAdded);
+        READWRITE(vOwnerAdded);
+    )
+
+    void SetNull()
+    {
+        mapPrevTxIndex.clear();
+        vTxAdded.clear();
+        vOwnerAdded.clear();
+    }
+
+    void AddPrevTxIndex(uint256 hash, const CTxIndex& txindex)
+    {
+        // Only the state from before the block counts
+        mapPrevTxIndex.insert(make_pair(hash, txindex));
+    }
+};
+
+
+
+
+
 //
 // Nodes collect new transactions into a block, hash them into a hash tree,
 // and scan through nonce values to make the block's hash satisfy proof-of-work
@@ -918,22 +1065,20 @@ public:
 
     bool WriteToDisk(bool fWriteTransactions, unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = AppendBlockFile(nFileRet);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+        CDataStream ss(SER_DISK);
         if (!fWriteTransactions)
-            fileout.nType |= SER_BLOCKHEADERONLY;
+            ss.nType |= SER_BLOCKHEADERONLY;
 
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
+        // Index header and block
+        unsigned int nSize = ss.GetSerializeSize(*this);
+        ss << FLATDATA(pchMessageStart) << nSize;
+        unsigned int nHeaderSize = ss.size();
+        ss << *this;
 
-        // Write block
-        nBlockPosRet = ftell(fileout);
-        if (nBlockPosRet == -1)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        fileout << *this;
+        // Append to history file
+        if (!AppendBlockFile(ss, nFileRet, nBlockPosRet))
+            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+        nBlockPosRet += nHeaderSize;
 
         return true;
     }
@@ -942,15 +1087,23 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        filein >> *this;
+        // Read block from the mapped file, or open it if that fails
+        CBlockFileStream filemap(nFile, nBlockPos);
+        if (!!filemap)
+        {
+            if (!fReadTransactions)
+                filemap.nType |= SER_BLOCKHEADERONLY;
+            filemap >> *this;
+        }
+        else
+        {
+            CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+            filein >> *this;
+        }
 
         // Check the header
         if (CBigNum().SetCompact(nBits) > bnProofOfWorkLimit)
@@ -1012,10 +1165,16 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
 
+    // Computed once by CacheChainValues, nTx is 0 if unknown
+    unsigned int nTx;
+    uint256 nChainWork;
+    unsigned int nMedianTimePast;
+
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1024,14 +1183,22 @@ public:
     unsigned int nNonce;
 
 
+    // Allocated from an arena in main.cpp
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+
     CBlockIndex()
     {
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
+        nTx = 0;
+        nChainWork = 0;
+        nMedianTimePast = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1045,9 +1212,13 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
+        nTx = block.vtx.size();
+        nChainWork = 0;
+        nMedianTimePast = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1061,11 +1232,31 @@ public:
         return *phashBlock;
     }
 
+    CBlock GetBlockHeader() const
+    {
+        CBlock block;
+        block.nVersion       = nVersion;
+        if (pprev)
+            block.hashPrevBlock = pprev->GetBlockHash();
+        block.hashMerkleRoot = hashMerkleRoot;
+        block.nTime          = nTime;
+        block.nBits          = nBits;
+        block.nNonce         = nNonce;
+        return block;
+    }
+
     bool IsInMainChain() const
     {
-        return (pnext || this == pindexBest);
+        return (nHeight < vMainChain.size() && vMainChain[nHeight] == this);
     }
 
+    // pskip points further back so walking to an ancestor takes
+    // O(log n) steps, build it once pprev and nHeight are set
+    void BuildSkip();
+    void CacheChainValues();
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool EraseBlockFromDisk()
     {
         // Open history file
@@ -1084,6 +1275,11 @@ public:
     enum { nMedianTimeSpan=11 };
 
     int64 GetMedianTimePast() const
+    {
+        return nMedianTimePast;
+    }
+
+    unsigned int ComputeMedianTimePast() const
     {
         unsigned int pmedian[nMedianTimeSpan];
         unsigned int* pbegin = &pmedian[nMedianTimeSpan];
@@ -1099,14 +1295,9 @@ public:
 
     int64 GetMedianTime() const
     {
-        const CBlockIndex* pindex = this;
-        for (int i = 0; i < nMedianTimeSpan/2; i++)
-        {
-            if (!pindex->pnext)
-                return nTime;
-            pindex = pindex->pnext;
-        }
-        return pindex->GetMedianTimePast();
+        if (!IsInMainChain() || nHeight + nMedianTimeSpan/2 >= vMainChain.size())
+            return nTime;
+        return vMainChain[nHeight + nMedianTimeSpan/2]->GetMedianTimePast();
     }
 
 
@@ -1133,27 +1324,34 @@ public:
 class CDiskBlockIndex : public CBlockIndex
 {
 public:
+    int nDiskVersion;
     uint256 hashPrev;
-    uint256 hashNext;
 
     CDiskBlockIndex()
     {
+        nDiskVersion = DISKINDEX_VERSION;
         hashPrev = 0;
-        hashNext = 0;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
+        nDiskVersion = DISKINDEX_VERSION;
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
-        hashNext = (pnext ? pnext->GetBlockHash() : 0);
     }
 
     IMPLEMENT_SERIALIZE
     (
+        // Older records have the writer's VERSION here.  Only write
+        // records made from a CBlockIndex, not ones read in old format.
         if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
+            READWRITE(nDiskVersion);
 
-        READWRITE(hashNext);
+        // pnext comes from the best chain at load now
+        if (nDiskVersion < 103)
+        {
+            uint256 hashNext;
+            READWRITE(hashNext);
+        }
         READWRITE(nFile);
         READWRITE(nBlockPos);
         READWRITE(nHeight);
@@ -1165,6 +1363,9 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+
+        if (nDiskVersion >= 102)
+            READWRITE(nTx);
     )
 
     uint256 GetBlockHash() const
@@ -1184,10 +1385,9 @@ public:
     {
         string str = "CDiskBlockIndex(";
         str += CBlockIndex::ToString();
-        str += strprintf("\n                hashBlock=%s, hashPrev=%s, hashNext=%s)",
+        str += strprintf("\n                hashBlock=%s, hashPrev=%s)",
             GetBlockHash().ToString().c_str(),
-            hashPrev.ToString().substr(0,14).c_str(),
-            hashNext.ToString().substr(0,14).c_str());
+            hashPrev.ToString().substr(0,14).c_str());
         return str;
     }
 
@@ -1204,6 +1404,210 @@ public:
 
 
 
+//
+// Block hash to CBlockIndex* table with the interface of the std::map it
+// replaces.  Open addressing with linear probing on the low bits of the
+// hash, which are already random.  Entries are allocated in chunks and
+// never move, so pointers to the keys like phashBlock stay valid when
+// the table grows.  The slot array itself is reallocated on growth, so
+// find() and iteration are done under cs_main.
+//
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef pair<const uint256, CBlockIndex*> value_type;
+    typedef unsigned int size_type;
+
+protected:
+    enum { CHUNK_SIZE = 4096 };
+    vector<value_type*> vSlot;
+    vector<value_type*> vChunk;
+    vector<value_type*> vFree;
+    unsigned int nChunkUsed;
+    unsigned int nSize;
+    unsigned int nDeleted;
+
+    // Marks a slot whose entry was erased so probing continues past it
+    value_type* Deleted() const { return (value_type*)this; }
+    bool IsUsed(unsigned int i) const { return vSlot[i] != NULL && vSlot[i] != Deleted(); }
+
+public:
+    class iterator
+    {
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef CBlockIndexMap::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() : pmap(NULL), i(0) { }
+        iterator(const CBlockIndexMap* pmapIn, unsigned int iIn) : pmap(pmapIn), i(iIn) { }
+
+        value_type& operator*() const  { return *pmap->vSlot[i]; }
+        value_type* operator->() const { return pmap->vSlot[i]; }
+        iterator& operator++()         { i++; SkipUnused(); return *this; }
+        iterator operator++(int)       { iterator tmp = *this; ++(*this); return tmp; }
+        bool operator==(const iterator& b) const { return i == b.i; }
+        bool operator!=(const iterator& b) const { return i != b.i; }
+
+    protected:
+        friend class CBlockIndexMap;
+        const CBlockIndexMap* pmap;
+        unsigned int i;
+
+        void SkipUnused()
+        {
+            while (i < pmap->vSlot.size() && !pmap->IsUsed(i))
+                i++;
+        }
+    };
+    typedef iterator const_iterator;
+
+    CBlockIndexMap()
+    {
+        nChunkUsed = CHUNK_SIZE;
+        nSize = 0;
+        nDeleted = 0;
+    }
+
+    ~CBlockIndexMap()
+    {
+        clear();
+    }
+
+    iterator begin() const         { iterator it(this, 0); it.SkipUnused(); return it; }
+    iterator end() const           { return iterator(this, vSlot.size()); }
+    size_type size() const         { return nSize; }
+    bool empty() const             { return nSize == 0; }
+    size_type count(const uint256& key) const { return find(key) != end() ? 1 : 0; }
+
+    iterator find(const uint256& key) const
+    {
+        if (vSlot.empty())
+            return end();
+        unsigned int nMask = vSlot.size() - 1;
+        for (unsigned int i = (unsigned int)key.Get64() & nMask;; i = (i + 1) & nMask)
+        {
+            if (vSlot[i] == NULL)
+                return end();
+            if (vSlot[i] != Deleted() && vSlot[i]->first == key)
+                return iterator(this, i);
+        }
+    }
+
+    pair<iterator, bool> insert(const pair<uint256, CBlockIndex*>& item)
+    {
+        iterator mi = find(item.first);
+        if (mi != end())
+            return make_pair(mi, false);
+
+        // Keep the table at most 3/4 full, counting erased slots
+        if ((nSize + nDeleted + 1) * 4 > vSlot.size() * 3)
+            Rehash(nSize * 2 < vSlot.size() / 2 ? vSlot.size() : max((unsigned int)1024, (unsigned int)vSlot.size() * 2));
+
+        // Allocate the entry
+        value_type* pitem;
+        if (!vFree.empty())
+        {
+            pitem = vFree.back();
+            vFree.pop_back();
+        }
+        else
+        {
+            if (nChunkUsed == CHUNK_SIZE)
+            {
+                value_type* pchunk = (value_type*)malloc(CHUNK_SIZE * sizeof(value_type));
+                if (!pchunk)
+                    throw bad_alloc();
+                vChunk.push_back(pchunk);
+                nChunkUsed = 0;
+            }
+            pitem = vChunk.back() + nChunkUsed++;
+        }
+        new (pitem) value_type(item.first, item.second);
+
+        unsigned int nMask = vSlot.size() - 1;
+        unsigned int i = (unsigned int)item.first.Get64() & nMask;
+        while (IsUsed(i))
+            i = (i + 1) & nMask;
+        if (vSlot[i] == Deleted())
+            nDeleted--;
+        vSlot[i] = pitem;
+        nSize++;
+        return make_pair(iterator(this, i), true);
+    }
+
+    size_type erase(const uint256& key)
+    {
+        iterator mi = find(key);
+        if (mi == end())
+            return 0;
+        erase(mi);
+        return 1;
+    }
+
+    void erase(iterator mi)
+    {
+        value_type* pitem = vSlot[mi.i];
+        pitem->~value_type();
+        vFree.push_back(pitem);
+        vSlot[mi.i] = Deleted();
+        nSize--;
+        nDeleted++;
+    }
+
+    CBlockIndex*& operator[](const uint256& key)
+    {
+        iterator mi = find(key);
+        if (mi == end())
+            mi = insert(make_pair(key, (CBlockIndex*)NULL)).first;
+        return (*mi).second;
+    }
+
+    void clear()
+    {
+        for (unsigned int i = 0; i < vSlot.size(); i++)
+            if (IsUsed(i))
+                vSlot[i]->~value_type();
+        foreach(value_type* pchunk, vChunk)
+            free(pchunk);
+        vSlot.clear();
+        vChunk.clear();
+        vFree.clear();
+        nChunkUsed = CHUNK_SIZE;
+        nSize = 0;
+        nDeleted = 0;
+    }
+
+protected:
+    void Rehash(unsigned int nSlots)
+    {
+        vector<value_type*> vOld;
+        vOld.swap(vSlot);
+        vSlot.resize(nSlots, NULL);
+        nDeleted = 0;
+        unsigned int nMask = nSlots - 1;
+        foreach(value_type* pitem, vOld)
+        {
+            if (pitem == NULL || pitem == Deleted())
+                continue;
+            unsigned int i = (unsigned int)pitem->first.Get64() & nMask;
+            while (vSlot[i] != NULL)
+                i = (i + 1) & nMask;
+            vSlot[i] = pitem;
+        }
+    }
+};
+
+
+
+
+
+
+
 //
 // Describes a place in the block chain to another node such that if the
 // other node doesn't have the same branch, it can find a recent common trunk.
@@ -1226,7 +1630,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1247,8 +1651,13 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            int nHeight = pindex->nHeight - nStep;
+            if (nHeight < 0)
+                pindex = NULL;
+            else if (pindex->IsInMainChain())
+                pindex = vMainChain[nHeight];
+            else
+                pindex = pindex->GetAncestor(nHeight);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1260,7 +1669,7 @@ public:
         // Find the first block the caller has in the main chain
         foreach(const uint256& hash, vHave)
         {
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1276,7 +1685,7 @@ public:
         // Find the first block the caller has in the main chain
         foreach(const uint256& hash, vHave)
         {
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1300,6 +1709,80 @@ public:
 
 
 
+//
+// A block sent as its header, the coinbase and a short ID for each other
+// transaction.  The receiver rebuilds it from mapTransactions and asks
+// for what it doesn't have with getblocktxn.  The IDs are salted per
+// block so nobody can line up collisions ahead of time.
+//
+class CCompactBlock
+{
+public:
+    enum { SHORTID_SIZE = 6 };
+
+    CBlock header;
+    uint64 nShortIDNonce;
+    vector<unsigned char> vchShortIDs;
+    CTransaction txCoinBase;
+
+
+    CCompactBlock()
+    {
+        nShortIDNonce = 0;
+    }
+
+    explicit CCompactBlock(const CBlock& block)
+    {
+        header = block;
+        header.vtx.clear();
+        nShortIDNonce = GetRand(_UI64_MAX);
+        txCoinBase = block.vtx[0];
+        uint256 hashKey = GetShortIDKey();
+        vchShortIDs.reserve((block.vtx.size() - 1) * SHORTID_SIZE);
+        for (int i = 1; i < block.vtx.size(); i++)
+        {
+            uint64 nShortID = GetShortID(hashKey, block.vtx[i].GetHash());
+            vchShortIDs.insert(vchShortIDs.end(), (unsigned char*)&nShortID, (unsigned char*)&nShortID + SHORTID_SIZE);
+        }
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        nSerSize += ::SerReadWrite(s, header, nType | SER_BLOCKHEADERONLY, nVersion, ser_action);
+        READWRITE(nShortIDNonce);
+        READWRITE(vchShortIDs);
+        READWRITE(txCoinBase);
+    )
+
+    unsigned int GetShortIDCount() const
+    {
+        return vchShortIDs.size() / SHORTID_SIZE;
+    }
+
+    uint64 GetShortID(unsigned int i) const
+    {
+        uint64 nShortID = 0;
+        memcpy(&nShortID, &vchShortIDs[i * SHORTID_SIZE], SHORTID_SIZE);
+        return nShortID;
+    }
+
+    uint256 GetShortIDKey() const
+    {
+        uint256 hash = header.GetHash();
+        return Hash(BEGIN(hash), END(hash), BEGIN(nShortIDNonce), END(nShortIDNonce));
+    }
+
+    static uint64 GetShortID(const uint256& hashKey, const uint256& hashTx)
+    {
+        uint256 hash = Hash(BEGIN(hashKey), END(hashKey), BEGIN(hashTx), END(hashTx));
+        return hash.Get64() & (((uint64)1 << (8 * SHORTID_SIZE)) - 1);
+    }
+};
+
+
+
+
+
 
 
 
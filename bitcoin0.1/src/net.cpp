@@ -20,18 +20,38 @@ void ThreadOpenConnections2(void* parg);
 bool fClient = false;
 uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK);
 CAddress addrLocalHost(0, DEFAULT_PORT, nLocalServices);
+CSocketReactor netreactor;
+CWakeEvent eventMessageHandler;
+int nMessageBatchMillis = 0;
+int nMessageThreads = 4;
+unsigned int nInventoryFilterSize = 20000;
+double dInventoryFilterFPRate = 0.000001;
+CCriticalSection cs_netStats;
+int nNetStatsInterval = 0;
+int64 nMessageQueueCount = 0;
+int64 nMessageQueueMicros = 0;
+int64 nMessageQueueMicrosMax = 0;
+int64 nBlockRelayCount = 0;
+int64 nBlockRelayMicros = 0;
+int64 nBlockRelayMicrosMax = 0;
 CNode nodeLocalHost(INVALID_SOCKET, CAddress("127.0.0.1", nLocalServices));
 CNode* pnodeLocalHost = &nodeLocalHost;
 bool fShutdown = false;
-array<bool, 10> vfThreadRunning;
+array<bool, 32> vfThreadRunning;
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
 map<vector<unsigned char>, CAddress> mapAddresses;
 CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSendBufferRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-map<CInv, int64> mapAlreadyAskedFor;
+map<CInv, CInvRequest> mapInvRequests;
+CCriticalSection cs_mapInvRequests;
+int64 nAskForCount = 0;
+int64 nAskForMicros = 0;
+int64 nAskForMicrosMax = 0;
+int64 nAskForRetries = 0;
+int64 nAskForTimeouts = 0;
 
 
 
@@ -191,6 +211,116 @@ void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1)
     }
 }
 
+bool AskForBegin(CNode* pnode, const CInv& inv, int64& nRetryTime)
+{
+    // Returns true if pnode should ask for inv now.  If another peer has
+    // it in flight, nRetryTime is when that one times out, else 0 for
+    // don't bother.
+    nRetryTime = 0;
+    int64 nNow = GetTimeMicros();
+    CRITICAL_BLOCK(cs_mapInvRequests)
+    {
+        CInvRequest& request = mapInvRequests[inv];
+        if (request.pnode)
+        {
+            nRetryTime = request.nTimeRequested + ASKFOR_TIMEOUT * 1000000 + 1;
+            return false;
+        }
+        if (request.fReceived)
+            return false;
+        if (!request.setTried.insert(pnode->addr.GetKey()).second)
+            return false;
+        if (request.nTimeFirstRequested == 0)
+            request.nTimeFirstRequested = nNow;
+        else
+            nAskForRetries++;
+        request.pnode = pnode;
+        request.nTimeRequested = nNow;
+        pnode->AddRef();
+        pnode->nAskForInFlight++;
+    }
+    return true;
+}
+
+static void AskForRelease(CInvRequest& request)
+{
+    int64 nMicros = GetTimeMicros() - request.nTimeRequested;
+    nAskForCount++;
+    nAskForMicros += nMicros;
+    nAskForMicrosMax = max(nAskForMicrosMax, nMicros);
+    request.pnode->nAskForInFlight--;
+    request.pnode->Release();
+    request.pnode = NULL;
+}
+
+void AskForReceived(CNode* pfrom, const CInv& inv)
+{
+    // pfrom answered, whether or not it turns out valid, so its slot is
+    // free.  A bad tx isn't asked for again until the entry expires, but
+    // a block body may have been mutated under a good header, so the next
+    // peer to announce it still gets asked.
+    CRITICAL_BLOCK(cs_mapInvRequests)
+    {
+        map<CInv, CInvRequest>::iterator mi = mapInvRequests.find(inv);
+        if (mi == mapInvRequests.end() || (*mi).second.pnode != pfrom)
+            return;
+        AskForRelease((*mi).second);
+        if (inv.type != MSG_BLOCK)
+            (*mi).second.fReceived = true;
+    }
+}
+
+void AskForDone(const CInv& inv)
+{
+    // We have it, however it got here
+    CRITICAL_BLOCK(cs_mapInvRequests)
+    {
+        map<CInv, CInvRequest>::iterator mi = mapInvRequests.find(inv);
+        if (mi == mapInvRequests.end())
+            return;
+        if ((*mi).second.pnode)
+            AskForRelease((*mi).second);
+        mapInvRequests.erase(mi);
+    }
+}
+
+bool AskForInFlight(const CInv& inv)
+{
+    CRITICAL_BLOCK(cs_mapInvRequests)
+    {
+        map<CInv, CInvRequest>::iterator mi = mapInvRequests.find(inv);
+        if (mi != mapInvRequests.end() && (*mi).second.pnode)
+            return true;
+    }
+    return false;
+}
+
+void CheckAskForTimeouts()
+{
+    // Take requests back from peers that are too slow or went away, the
+    // next peer to announce it gets asked.  Forget items nobody delivered.
+    int64 nNow = GetTimeMicros();
+    CRITICAL_BLOCK(cs_mapInvRequests)
+    {
+        for (map<CInv, CInvRequest>::iterator mi = mapInvRequests.begin(); mi != mapInvRequests.end();)
+        {
+            CInvRequest& request = (*mi).second;
+            if (request.pnode && (request.pnode->fDisconnect || nNow - request.nTimeRequested > ASKFOR_TIMEOUT * 1000000))
+            {
+                printf("askfor %s timed out on %s\n", (*mi).first.ToString().c_str(), request.pnode->addr.ToString().c_str());
+                nAskForTimeouts++;
+                request.pnode->nAskForInFlight--;
+                request.pnode->Release();
+                request.pnode = NULL;
+            }
+            if (!request.pnode && nNow - request.nTimeFirstRequested > ASKFOR_EXPIRE * 1000000)
+                mapInvRequests.erase(mi++);
+            else
+                mi++;
+        }
+    }
+}
+
 
 
 
@@ -274,6 +404,17 @@ void CNode::CancelSubscribe(unsigned int nChannel)
 
 
 
+CSendBufferRef MakeMessageBuffer(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK);
+    ss.reserve(sizeof(CMessageHeader) + ssPayload.size());
+    ss << CMessageHeader(pszCommand, ssPayload.size());
+    ss += ssPayload;
+    CSendBufferRef pbuf(new CSerializeData());
+    ss.GetAndClear(*pbuf);
+    return pbuf;
+}
+
 CNode* FindNode(unsigned int ip)
 {
     CRITICAL_BLOCK(cs_vNodes)
@@ -317,6 +458,8 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
 
     // Connect
     SOCKET hSocket;
+    if (!netreactor.HaveRoom())
+        return NULL;
     if (ConnectSocket(addrConnect, hSocket))
     {
         /// debug print
@@ -343,11 +486,79 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
     }
 }
 
+unsigned int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    // Skip to the message start a byte at a time, its bytes are all
+    // different so a mismatch can only be the start of a new match
+    unsigned int nRead = 0;
+    unsigned int nSkipped = 0;
+    while (nRead < nBytes && nHeaderPos < sizeof(pchHeader))
+    {
+        char c = pch[nRead++];
+        if (nHeaderPos < sizeof(::pchMessageStart) && c != ::pchMessageStart[nHeaderPos])
+        {
+            nSkipped += nHeaderPos + (c == ::pchMessageStart[0] ? 0 : 1);
+            nHeaderPos = (c == ::pchMessageStart[0] ? 1 : 0);
+            pchHeader[0] = c;
+            continue;
+        }
+        pchHeader[nHeaderPos++] = c;
+    }
+    if (nSkipped > 0)
+        printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", nSkipped);
+    if (nHeaderPos < sizeof(pchHeader))
+        return nRead;
+
+    CDataStream ss(pchHeader, pchHeader + sizeof(pchHeader), SER_NETWORK);
+    ss >> hdr;
+    if (!hdr.IsValid() || hdr.nMessageSize > MAX_SIZE)
+    {
+        printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+        nHeaderPos = 0;
+        return nRead;
+    }
+
+    // Don't trust the size for more than a modest allocation up front
+    fInData = true;
+    vRecv.reserve(min(hdr.nMessageSize, 0x100000U));
+    if (hdr.nMessageSize == 0)
+        nTimeComplete = GetTimeMicros();
+    return nRead;
+}
+
+unsigned int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min(GetDataRemaining(), nBytes);
+    memcpy(PrepareData(nCopy), pch, nCopy);
+    CommitData(nCopy);
+    return nCopy;
+}
+
+void CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    // Caller holds cs_vRecv
+    while (nBytes > 0)
+    {
+        if (vRecvMsg.empty() || vRecvMsg.back().IsComplete())
+            vRecvMsg.push_back(CNetMessage());
+        CNetMessage& msg = vRecvMsg.back();
+        unsigned int nRead = (msg.fInData ? msg.ReadData(pch, nBytes) : msg.ReadHeader(pch, nBytes));
+        pch += nRead;
+        nBytes -= nRead;
+    }
+}
+
 void CNode::Disconnect()
 {
     printf("disconnecting node %s\n", addr.ToString().c_str());
 
-    closesocket(hSocket);
+    // EndMessage checks hSocket under cs_vSend before asking for writes
+    CRITICAL_BLOCK(cs_vSend)
+    {
+        netreactor.Remove(hSocket);
+        closesocket(hSocket);
+        hSocket = INVALID_SOCKET;
+    }
 
     // All of a nodes broadcasts and subscriptions are automatically torn down
     // when it goes down, so a node has to stay up to keep its broadcast going.
@@ -374,6 +585,284 @@ void CNode::Disconnect()
 
 
 
+//
+// CSocketReactor
+//
+
+CSocketReactor::CSocketReactor()
+{
+    hSocketWake = INVALID_SOCKET;
+}
+
+CSocketReactor::~CSocketReactor()
+{
+    if (hSocketWake != INVALID_SOCKET)
+        closesocket(hSocketWake);
+}
+
+bool CSocketReactor::Init()
+{
+    if (hSocketWake != INVALID_SOCKET)
+        return true;
+
+    // Loopback datagram socket connected to itself, a send wakes select
+    SOCKET hSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (hSocket == INVALID_SOCKET)
+        return error("CSocketReactor::Init() : socket failed %d", WSAGetLastError());
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sockaddr.sin_port = 0;
+    int len = sizeof(sockaddr);
+    u_long nOne = 1;
+    if (bind(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR ||
+        getsockname(hSocket, (struct sockaddr*)&sockaddr, &len) == SOCKET_ERROR ||
+        connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR ||
+        ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        closesocket(hSocket);
+        return error("CSocketReactor::Init() : wakeup socket failed %d", nErr);
+    }
+    hSocketWake = hSocket;
+    return true;
+}
+
+bool CSocketReactor::Add(SOCKET hSocket, void* p)
+{
+    // Non-blocking, so a read after select reports the socket ready can't hang
+    u_long nOne = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+        return error("CSocketReactor::Add() : ioctlsocket failed %d", WSAGetLastError());
+    CRITICAL_BLOCK(cs_mapSockets)
+    {
+        // FD_SET silently drops sockets past FD_SETSIZE, they'd never be read
+        if (mapSockets.size() + 1 >= FD_SETSIZE)
+            return error("CSocketReactor::Add() : more than %d sockets", FD_SETSIZE - 1);
+        mapSockets[hSocket] = make_pair(p, false);
+    }
+    Wakeup();
+    return true;
+}
+
+void CSocketReactor::Remove(SOCKET hSocket)
+{
+    CRITICAL_BLOCK(cs_mapSockets)
+        mapSockets.erase(hSocket);
+}
+
+bool CSocketReactor::HaveRoom()
+{
+    // One slot is kept for the wakeup socket
+    CRITICAL_BLOCK(cs_mapSockets)
+        return (mapSockets.size() + 1 < FD_SETSIZE);
+    return false;
+}
+
+void CSocketReactor::SetWrite(SOCKET hSocket, void* p, bool fWrite)
+{
+    CRITICAL_BLOCK(cs_mapSockets)
+    {
+        map<SOCKET, pair<void*, bool> >::iterator mi = mapSockets.find(hSocket);
+        if (mi != mapSockets.end())
+            (*mi).second.second = fWrite;
+    }
+    if (fWrite)
+        Wakeup();
+}
+
+bool CSocketReactor::Wait(vector<pair<void*, int> >& vEvents, int nTimeoutMillis)
+{
+    vEvents.clear();
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeoutMillis / 1000;
+    timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+
+    struct fd_set fdsetRecv;
+    struct fd_set fdsetSend;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    SOCKET hSocketMax = 0;
+    if (hSocketWake != INVALID_SOCKET)
+    {
+        FD_SET(hSocketWake, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hSocketWake);
+    }
+    vector<pair<SOCKET, void*> > vSockets;
+    CRITICAL_BLOCK(cs_mapSockets)
+    {
+        vSockets.reserve(mapSockets.size());
+        for (map<SOCKET, pair<void*, bool> >::iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi)
+        {
+            SOCKET hSocket = (*mi).first;
+            vSockets.push_back(make_pair(hSocket, (*mi).second.first));
+            FD_SET(hSocket, &fdsetRecv);
+            if ((*mi).second.second)
+                FD_SET(hSocket, &fdsetSend);
+            hSocketMax = max(hSocketMax, hSocket);
+        }
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+    if (nSelect == SOCKET_ERROR)
+        return error("select failed: %d", WSAGetLastError());
+
+    if (hSocketWake != INVALID_SOCKET && FD_ISSET(hSocketWake, &fdsetRecv))
+    {
+        char pchBuf[64];
+        while (recv(hSocketWake, pchBuf, sizeof(pchBuf), 0) > 0)
+            ;
+    }
+
+    for (vector<pair<SOCKET, void*> >::iterator it = vSockets.begin(); it != vSockets.end(); ++it)
+    {
+        int nFlags = 0;
+        if (FD_ISSET((*it).first, &fdsetRecv))
+            nFlags |= SOCKET_EVENT_READ;
+        if (FD_ISSET((*it).first, &fdsetSend))
+            nFlags |= SOCKET_EVENT_WRITE;
+        if (nFlags)
+            vEvents.push_back(make_pair((*it).second, nFlags));
+    }
+    return true;
+}
+
+void CSocketReactor::Wakeup()
+{
+    if (hSocketWake != INVALID_SOCKET)
+        send(hSocketWake, "", 1, 0);
+}
+
+
+
+
+
+
+
+
+
+
+
+// Read until the socket would block, false if there may be more to read
+bool SocketRecvData(CNode* pnode)
+{
+    // Caller holds cs_vRecv, only the socket handler thread uses pchBuf
+    static char pchBuf[0x10000];
+    for (int i = 0; i < 16; i++)
+    {
+        // Large payloads are read straight into the message being framed
+        CNetMessage* pmsg = NULL;
+        char* pch = pchBuf;
+        unsigned int nBufSize = sizeof(pchBuf);
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().GetDataRemaining() >= nBufSize)
+        {
+            pmsg = &pnode->vRecvMsg.back();
+            pch = pmsg->PrepareData(nBufSize);
+        }
+
+        int nBytes = recv(pnode->hSocket, pch, nBufSize, 0);
+        if (pmsg)
+            pmsg->CommitData(max(nBytes, 0));
+        else if (nBytes > 0)
+            pnode->ReceiveMsgBytes(pch, nBytes);
+
+        if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                printf("recv: socket closed\n");
+            pnode->fDisconnect = true;
+            return true;
+        }
+        else if (nBytes < 0)
+        {
+            // socket error
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEINTR)
+                continue;
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    printf("recv failed: %d\n", nErr);
+                pnode->fDisconnect = true;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send until the queue is empty or the socket would block
+void SocketSendData(CNode* pnode)
+{
+    // Caller holds cs_vSend
+    deque<CSendBufferRef>& vSendMsg = pnode->vSendMsg;
+    while (!vSendMsg.empty())
+    {
+        // Gather the queued messages into one call, the first one may be
+        // partly sent already
+        WSABUF vBuf[64];
+        int nBufs = 0;
+        unsigned int nOffset = pnode->nSendOffset;
+        for (deque<CSendBufferRef>::iterator it = vSendMsg.begin(); it != vSendMsg.end() && nBufs < ARRAYLEN(vBuf); ++it)
+        {
+            CSerializeData& vch = **it;
+            vBuf[nBufs].buf = &vch[nOffset];
+            vBuf[nBufs].len = vch.size() - nOffset;
+            nBufs++;
+            nOffset = 0;
+        }
+
+        DWORD nSent = 0;
+        int nBytes = (WSASend(pnode->hSocket, vBuf, nBufs, &nSent, 0, NULL, NULL) == SOCKET_ERROR ? -1 : nSent);
+        if (nBytes > 0)
+        {
+            // Advance by offsets, dropping our reference to finished messages
+            unsigned int nLeft = nBytes;
+            while (nLeft > 0)
+            {
+                unsigned int nRemain = vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nLeft < nRemain)
+                {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemain;
+                pnode->nSendOffset = 0;
+                vSendMsg.pop_front();
+            }
+            continue;
+        }
+        if (nBytes < 0)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEINTR)
+                continue;
+            if (nErr == WSAEWOULDBLOCK || nErr == WSAEINPROGRESS)
+                return;
+            printf("send error %d\n", nErr);
+            pnode->fDisconnect = true;
+        }
+        if (pnode->ReadyToDisconnect())
+        {
+            vSendMsg.clear();
+            pnode->nSendOffset = 0;
+        }
+        return;
+    }
+}
+
+
+
+
+
+
+
+
+
+
 void ThreadSocketHandler(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadSocketHandler(parg));
@@ -397,6 +886,7 @@ void ThreadSocketHandler2(void* parg)
     printf("ThreadSocketHandler started\n");
     SOCKET hListenSocket = *(SOCKET*)parg;
     list<CNode*> vNodesDisconnected;
+    vector<CNode*> vRecvPending;
     int nPrevNodeCount = 0;
 
     loop
@@ -441,10 +931,11 @@ void ThreadSocketHandler2(void* parg)
             vector<CNode*> vNodesCopy = vNodes;
             foreach(CNode* pnode, vNodesCopy)
             {
-                if (pnode->ReadyToDisconnect() && pnode->vRecv.empty() && pnode->vSend.empty())
+                if (pnode->ReadyToDisconnect() && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty())
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    vRecvPending.erase(remove(vRecvPending.begin(), vRecvPending.end(), pnode), vRecvPending.end());
                     pnode->Disconnect();
 
                     // hold in disconnected pool until all refs are released
@@ -484,162 +975,97 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for socket events
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        struct fd_set fdsetRecv;
-        struct fd_set fdsetSend;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        SOCKET hSocketMax = 0;
-        FD_SET(hListenSocket, &fdsetRecv);
-        hSocketMax = max(hSocketMax, hListenSocket);
-        CRITICAL_BLOCK(cs_vNodes)
-        {
-            foreach(CNode* pnode, vNodes)
-            {
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-            }
-        }
-
+        vector<pair<void*, int> > vEvents;
         vfThreadRunning[0] = false;
-        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        if (!netreactor.Wait(vEvents, vRecvPending.empty() ? 250 : 5))
+            Sleep(50);
         vfThreadRunning[0] = true;
         CheckForShutdown(0);
-        if (nSelect == SOCKET_ERROR)
-        {
-            int nErr = WSAGetLastError();
-            printf("select failed: %d\n", nErr);
-            for (int i = 0; i <= hSocketMax; i++)
-            {
-                FD_SET(i, &fdsetRecv);
-                FD_SET(i, &fdsetSend);
-            }
-            Sleep(timeout.tv_usec/1000);
-        }
         RandAddSeed();
 
-        //// debug print
-        //foreach(CNode* pnode, vNodes)
-        //{
-        //    printf("vRecv = %-5d ", pnode->vRecv.size());
-        //    printf("vSend = %-5d    ", pnode->vSend.size());
-        //}
-        //printf("\n");
+        // Nodes we couldn't finish reading last time are retried first
+        set<CNode*> setRecv(vRecvPending.begin(), vRecvPending.end());
+        vRecvPending.clear();
 
-
-        //
-        // Accept new connections
-        //
-        if (FD_ISSET(hListenSocket, &fdsetRecv))
+        foreach(const PAIRTYPE(void*, int)& item, vEvents)
         {
-            struct sockaddr_in sockaddr;
-            int len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr(sockaddr);
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("ERROR ThreadSocketHandler accept failed: %d\n", WSAGetLastError());
-            }
-            else
-            {
-                printf("accepted connection from %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, true);
-                pnode->AddRef();
-                CRITICAL_BLOCK(cs_vNodes)
-                    vNodes.push_back(pnode);
-            }
-        }
-
-
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        CRITICAL_BLOCK(cs_vNodes)
-            vNodesCopy = vNodes;
-        foreach(CNode* pnode, vNodesCopy)
-        {
-            CheckForShutdown(0);
-            SOCKET hSocket = pnode->hSocket;
-
             //
-            // Receive
+            // Accept new connections
             //
-            if (FD_ISSET(hSocket, &fdsetRecv))
+            if (item.first == NULL)
             {
-                TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+                loop
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    // typical socket buffer is 8K-64K
-                    const unsigned int nBufSize = 0x10000;
-                    vRecv.resize(nPos + nBufSize);
-                    int nBytes = recv(hSocket, &vRecv[nPos], nBufSize, 0);
-                    vRecv.resize(nPos + max(nBytes, 0));
-                    if (nBytes == 0)
+                    struct sockaddr_in sockaddr;
+                    int len = sizeof(sockaddr);
+                    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+                    CAddress addr(sockaddr);
+                    if (hSocket == INVALID_SOCKET)
                     {
-                        // socket closed gracefully
-                        if (!pnode->fDisconnect)
-                            printf("recv: socket closed\n");
-                        pnode->fDisconnect = true;
+                        if (WSAGetLastError() != WSAEWOULDBLOCK)
+                            printf("ERROR ThreadSocketHandler accept failed: %d\n", WSAGetLastError());
+                        break;
                     }
-                    else if (nBytes < 0)
+                    if (!netreactor.HaveRoom())
                     {
-                        // socket error
-                        int nErr = WSAGetLastError();
-                        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                        {
-                            if (!pnode->fDisconnect)
-                                printf("recv failed: %d\n", nErr);
-                            pnode->fDisconnect = true;
-                        }
+                        printf("socket limit reached, refusing connection from %s\n", addr.ToString().c_str());
+                        closesocket(hSocket);
+                        continue;
                     }
+                    printf("accepted connection from %s\n", addr.ToString().c_str());
+                    CNode* pnode = new CNode(hSocket, addr, true);
+                    pnode->AddRef();
+                    CRITICAL_BLOCK(cs_vNodes)
+                        vNodes.push_back(pnode);
                 }
+                continue;
             }
 
+            CNode* pnode = (CNode*)item.first;
+            if (item.second & SOCKET_EVENT_READ)
+                setRecv.insert(pnode);
+
             //
             // Send
             //
-            if (FD_ISSET(hSocket, &fdsetSend))
+            if (item.second & SOCKET_EVENT_WRITE)
             {
-                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (pnode->hSocket != INVALID_SOCKET)
+                        SocketSendData(pnode);
+                    if (pnode->vSendMsg.empty() && pnode->fSendWait)
                     {
-                        int nBytes = send(hSocket, &vSend[0], vSend.size(), 0);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            if (pnode->ReadyToDisconnect())
-                                pnode->vSend.clear();
-                        }
-                        else
-                        {
-                            printf("send error %d\n", nBytes);
-                            if (pnode->ReadyToDisconnect())
-                                pnode->vSend.clear();
-                        }
+                        pnode->fSendWait = false;
+                        if (pnode->hSocket != INVALID_SOCKET)
+                            netreactor.SetWrite(pnode->hSocket, pnode, false);
                     }
                 }
             }
         }
 
+        //
+        // Receive
+        //
+        foreach(CNode* pnode, setRecv)
+        {
+            // The message handler holds cs_vRecv while processing, come back for it
+            bool fDone = false;
+            bool fComplete = false;
+            TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+            {
+                fDone = SocketRecvData(pnode);
+                fComplete = (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().IsComplete());
+            }
+            if (!fDone)
+                vRecvPending.push_back(pnode);
 
-        Sleep(10);
+            // Signal after letting go of cs_vRecv so the handler can take it
+            if (fComplete || pnode->fDisconnect)
+                eventMessageHandler.Set();
+        }
     }
 }
 
@@ -795,54 +1221,96 @@ void ThreadOpenConnections2(void* parg)
 
 
 
+// Message worker 0 keeps the original thread slot, the rest go past the
+// fixed ones
+static int MessageThreadSlot(int nThread)
+{
+    return (nThread == 0 ? 2 : 9 + nThread);
+}
+
 void ThreadMessageHandler(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadMessageHandler(parg));
+    int nSlot = MessageThreadSlot((int)(size_t)parg);
 
     loop
     {
-        vfThreadRunning[2] = true;
-        CheckForShutdown(2);
+        vfThreadRunning[nSlot] = true;
+        CheckForShutdown(nSlot);
         try
         {
             ThreadMessageHandler2(parg);
         }
         CATCH_PRINT_EXCEPTION("ThreadMessageHandler()")
-        vfThreadRunning[2] = false;
+        vfThreadRunning[nSlot] = false;
         Sleep(5000);
     }
 }
 
 void ThreadMessageHandler2(void* parg)
 {
-    printf("ThreadMessageHandler started\n");
+    // Several of these run at once.  A node's cs_vRecv is held while its
+    // messages are processed, so each peer's messages stay in order while
+    // different peers are handled in parallel.
+    int nThread = (int)(size_t)parg;
+    int nSlot = MessageThreadSlot(nThread);
+    printf("ThreadMessageHandler %d started\n", nThread);
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nLastStats = GetTime();
     loop
     {
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages, each worker starting at a
+        // different node
+        bool fBusy = false;
         vector<CNode*> vNodesCopy;
         CRITICAL_BLOCK(cs_vNodes)
             vNodesCopy = vNodes;
+        if (!vNodesCopy.empty())
+            rotate(vNodesCopy.begin(), vNodesCopy.begin() + (nThread % vNodesCopy.size()), vNodesCopy.end());
         foreach(CNode* pnode, vNodesCopy)
         {
             pnode->AddRef();
 
-            // Receive messages
+            // Receive messages, waking another worker for the other nodes
             TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+            {
+                if (nMessageThreads > 1 && !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().IsComplete())
+                    eventMessageHandler.Set();
                 ProcessMessages(pnode);
+            }
 
-            // Send messages
+            // Send messages.  ProcessMessage pushes replies holding cs_main
+            // then cs_vSend.  Taking them the other way round here is safe
+            // because neither is waited for, and a node whose send queue is
+            // busy doesn't hold up the workers on cs_main.
+            bool fSend = false;
             TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                SendMessages(pnode);
+                TRY_CRITICAL_BLOCK(cs_main)
+                {
+                    SendMessages(pnode);
+                    fSend = true;
+                }
+            if (!fSend)
+                fBusy = true;
 
             pnode->Release();
+            CheckForShutdown(nSlot);
+        }
+
+        if (nThread == 0 && nNetStatsInterval > 0 && GetTime() - nLastStats >= nNetStatsInterval)
+        {
+            nLastStats = GetTime();
+            PrintNetStats();
         }
 
-        // Wait and allow messages to bunch up
-        vfThreadRunning[2] = false;
-        Sleep(100);
-        vfThreadRunning[2] = true;
-        CheckForShutdown(2);
+        // Sleep until the socket handler has a complete message or there's
+        // inventory to offer.  The timeout covers timed work like mapAskFor,
+        // and comes around quickly if a node's send queue was locked.
+        vfThreadRunning[nSlot] = false;
+        if (eventMessageHandler.Wait(fBusy ? 10 : 1000) && nMessageBatchMillis > 0)
+            Sleep(nMessageBatchMillis);
+        vfThreadRunning[nSlot] = true;
+        CheckForShutdown(nSlot);
     }
 }
 
@@ -853,7 +1321,6 @@ void ThreadMessageHandler2(void* parg)
 
 
 
-
 //// todo: start one thread per processor, use getenv("NUMBER_OF_PROCESSORS")
 void ThreadBitcoinMiner(void* parg)
 {
@@ -971,6 +1438,13 @@ bool StartNode(string& strError)
     //
     // Start threads
     //
+    if (!netreactor.Init() || !netreactor.Add(hListenSocket, NULL))
+    {
+        strError = "Error: Unable to set up socket event notification";
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+
     if (_beginthread(ThreadSocketHandler, 0, new SOCKET(hListenSocket)) == -1)
     {
         strError = "Error: _beginthread(ThreadSocketHandler) failed";
@@ -985,11 +1459,14 @@ bool StartNode(string& strError)
         return false;
     }
 
-    if (_beginthread(ThreadMessageHandler, 0, NULL) == -1)
+    for (int i = 0; i < nMessageThreads; i++)
     {
-        strError = "Error: _beginthread(ThreadMessageHandler) failed";
-        printf("%s\n", strError.c_str());
-        return false;
+        if (_beginthread(ThreadMessageHandler, 0, (void*)(size_t)i) == -1)
+        {
+            strError = "Error: _beginthread(ThreadMessageHandler) failed";
+            printf("%s\n", strError.c_str());
+            return false;
+        }
     }
 
     return true;
@@ -1000,6 +1477,8 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    netreactor.Wakeup();
+    eventMessageHandler.Set();
     while (count(vfThreadRunning.begin(), vfThreadRunning.end(), true))
         Sleep(10);
     Sleep(50);
@@ -1009,6 +1488,32 @@ bool StopNode()
     return true;
 }
 
+void PrintNetStats()
+{
+    unsigned int nFilterBytes = 0;
+    unsigned int nNodes = 0;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        nNodes = vNodes.size();
+        foreach(CNode* pnode, vNodes)
+            nFilterBytes += pnode->filterAddrKnown.GetMemoryUsage() + pnode->filterInventoryKnown.GetMemoryUsage();
+    }
+    printf("netstats: %d nodes, %u bytes of known inventory and addr filters per node\n", nNodes, nNodes ? nFilterBytes / nNodes : 0);
+    printf("netstats: %d nodes, %I64d messages queued avg %I64dus max %I64dus, %I64d block relays avg %I64dus max %I64dus\n",
+           nNodes,
+           nMessageQueueCount, nMessageQueueCount ? nMessageQueueMicros / nMessageQueueCount : 0, nMessageQueueMicrosMax,
+           nBlockRelayCount, nBlockRelayCount ? nBlockRelayMicros / nBlockRelayCount : 0, nBlockRelayMicrosMax);
+    printf("netstats block cache: %I64d hits %I64d misses\n", nBlockMessageCacheHits, nBlockMessageCacheMisses);
+    CRITICAL_BLOCK(cs_mapInvRequests)
+        printf("netstats getdata: %d outstanding, %I64d delivered avg %I64dus max %I64dus, %I64d retries %I64d timeouts\n",
+               mapInvRequests.size(), nAskForCount, nAskForCount ? nAskForMicros / nAskForCount : 0, nAskForMicrosMax, nAskForRetries, nAskForTimeouts);
+    TRY_CRITICAL_BLOCK(cs_main)
+    {
+        printf("netstats sync: best header %d, best block %d, %d blocks in flight\n", GetBestHeader()->nHeight, nBestHeight, mapBlocksInFlight.size());
+        printf("netstats compact blocks: %I64d received, %I64d needed getblocktxn, %I64d fell back to block\n", nCompactBlocksReceived, nCompactBlocksTxRequested, nCompactBlocksFailed);
+    }
+}
+
 void CheckForShutdown(int n)
 {
     if (fShutdown)
@@ -10,8 +10,15 @@ class CNode;
 
 
 
+// A framed message, header included, that any number of send queues can share
+typedef shared_ptr<CSerializeData> CSendBufferRef;
+
 static const unsigned short DEFAULT_PORT = htons(8333);
 static const unsigned int PUBLISH_HOPS = 5;
+static const int MAX_MESSAGE_THREADS = 16;
+static const int MAX_ASKFOR_IN_FLIGHT = 100;
+static const int64 ASKFOR_TIMEOUT = 60;
+static const int64 ASKFOR_EXPIRE = 20 * 60;
 enum
 {
     NODE_NETWORK = (1 << 0),
@@ -29,10 +36,17 @@ CNode* FindNode(unsigned int ip);
 CNode* ConnectNode(CAddress addrConnect, int64 nTimeout=0);
 void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1);
 bool AnySubscribed(unsigned int nChannel);
+bool AskForBegin(CNode* pnode, const CInv& inv, int64& nRetryTime);
+void AskForReceived(CNode* pfrom, const CInv& inv);
+void AskForDone(const CInv& inv);
+bool AskForInFlight(const CInv& inv);
+void CheckAskForTimeouts();
+CSendBufferRef MakeMessageBuffer(const char* pszCommand, const CDataStream& ssPayload);
 void ThreadBitcoinMiner(void* parg);
 bool StartNode(string& strError=REF(string()));
 bool StopNode();
 void CheckForShutdown(int n);
+void PrintNetStats();
 
 
 
@@ -362,6 +376,11 @@ public:
         return (a.type < b.type || (a.type == b.type && a.hash < b.hash));
     }
 
+    friend inline bool operator==(const CInv& a, const CInv& b)
+    {
+        return (a.type == b.type && a.hash == b.hash);
+    }
+
     bool IsKnownType() const
     {
         return (type >= 1 && type < ARRAYLEN(ppszTypeName));
@@ -409,28 +428,171 @@ public:
 
 
 
+//
+// An item we asked a peer for with getdata.  Only one peer is asked at a
+// time, if it hasn't delivered by the deadline the next peer that
+// announced it gets a turn.  The peer is AddRef'd while it's asked, the
+// ones tried are remembered by address so no pointer outlives its node.
+//
+class CInvRequest
+{
+public:
+    CNode* pnode;
+    int64 nTimeRequested;
+    int64 nTimeFirstRequested;
+    set<vector<unsigned char> > setTried;
+    bool fReceived;
+
+    CInvRequest()
+    {
+        pnode = NULL;
+        nTimeRequested = 0;
+        nTimeFirstRequested = 0;
+        fReceived = false;
+    }
+};
+
+
+
+
+
+//
+// Socket readiness for the socket handler thread.  This is a level
+// triggered select over the registered sockets: every socket is watched
+// for reading, and only asks for writable events while its send queue is
+// non-empty.  Wakeup() kicks a thread blocked in Wait().  It holds at most
+// FD_SETSIZE (headers.h) sockets including the wakeup socket.
+//
+enum
+{
+    SOCKET_EVENT_READ = (1 << 0),
+    SOCKET_EVENT_WRITE = (1 << 1),
+};
+
+class CSocketReactor
+{
+protected:
+    map<SOCKET, pair<void*, bool> > mapSockets;
+    CCriticalSection cs_mapSockets;
+    SOCKET hSocketWake;
+
+public:
+    CSocketReactor();
+    ~CSocketReactor();
+    bool Init();
+    bool Add(SOCKET hSocket, void* p);
+    void Remove(SOCKET hSocket);
+    bool HaveRoom();
+    void SetWrite(SOCKET hSocket, void* p, bool fWrite);
+    bool Wait(vector<pair<void*, int> >& vEvents, int nTimeoutMillis);
+    void Wakeup();
+
+private:
+    CSocketReactor(const CSocketReactor&);
+    void operator=(const CSocketReactor&);
+};
+
+
+
 
 
 extern bool fClient;
 extern uint64 nLocalServices;
 extern CAddress addrLocalHost;
 extern CNode* pnodeLocalHost;
+extern CSocketReactor netreactor;
+extern CWakeEvent eventMessageHandler;
+extern int nMessageBatchMillis;
+extern int nMessageThreads;
+extern unsigned int nInventoryFilterSize;
+extern double dInventoryFilterFPRate;
+extern CCriticalSection cs_netStats;
+extern int nNetStatsInterval;
+extern int64 nMessageQueueCount;
+extern int64 nMessageQueueMicros;
+extern int64 nMessageQueueMicrosMax;
+extern int64 nBlockRelayCount;
+extern int64 nBlockRelayMicros;
+extern int64 nBlockRelayMicrosMax;
 extern bool fShutdown;
-extern array<bool, 10> vfThreadRunning;
+extern array<bool, 32> vfThreadRunning;
 extern vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern map<vector<unsigned char>, CAddress> mapAddresses;
 extern CCriticalSection cs_mapAddresses;
-extern map<CInv, CDataStream> mapRelay;
+extern map<CInv, CSendBufferRef> mapRelay;
 extern deque<pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern map<CInv, int64> mapAlreadyAskedFor;
+extern map<CInv, CInvRequest> mapInvRequests;
+extern CCriticalSection cs_mapInvRequests;
+extern int64 nAskForCount;
+extern int64 nAskForMicros;
+extern int64 nAskForMicrosMax;
+extern int64 nAskForRetries;
+extern int64 nAskForTimeouts;
 extern CAddress addrProxy;
 
 
 
 
 
+//
+// A message being framed off the wire.  The header is parsed once, then the
+// payload is read straight into vRecv, which is what ProcessMessage reads.
+//
+class CNetMessage
+{
+public:
+    char pchHeader[sizeof(CMessageHeader)];
+    unsigned int nHeaderPos;
+    CMessageHeader hdr;
+    bool fInData;
+    CDataStream vRecv;
+    unsigned int nDataPos;
+    int64 nTimeStart;
+    int64 nTimeComplete;
+
+    CNetMessage() : vRecv(SER_NETWORK)
+    {
+        nHeaderPos = 0;
+        fInData = false;
+        nDataPos = 0;
+        nTimeStart = GetTime();
+        nTimeComplete = 0;
+    }
+
+    bool IsComplete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
+
+    unsigned int GetDataRemaining() const
+    {
+        return fInData ? hdr.nMessageSize - nDataPos : 0;
+    }
+
+    char* PrepareData(unsigned int nSize)
+    {
+        vRecv.resize(nDataPos + nSize);
+        return &vRecv[nDataPos];
+    }
+
+    void CommitData(unsigned int nSize)
+    {
+        nDataPos += nSize;
+        vRecv.resize(nDataPos);
+        if (nSize > 0 && IsComplete())
+            nTimeComplete = GetTimeMicros();
+    }
+
+    unsigned int ReadHeader(const char* pch, unsigned int nBytes);
+    unsigned int ReadData(const char* pch, unsigned int nBytes);
+};
+
+
+
+
+
 class CNode
 {
 public:
@@ -438,7 +600,11 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    deque<CSendBufferRef> vSendMsg;
+    unsigned int nSendOffset;
+    deque<CNetMessage> vRecvMsg;
+    int nRecvType;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     unsigned int nPushPos;
@@ -448,6 +614,8 @@ public:
     bool fInbound;
     bool fNetworkNode;
     bool fDisconnect;
+    bool fSendWait;
+    int64 nTimeMessageComplete;
 protected:
     int nRefCount;
 public:
@@ -457,25 +625,37 @@ public:
 
     // flood
     vector<CAddress> vAddrToSend;
-    set<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
 
     // inventory based relay
-    set<CInv> setInventoryKnown;
-    set<CInv> setInventoryKnown2;
+    CRollingBloomFilter filterInventoryKnown;
     vector<CInv> vInventoryToSend;
+    vector<CInv> vInventoryResend;
     CCriticalSection cs_inventory;
     multimap<int64, CInv> mapAskFor;
+    int nAskForInFlight;
+
+    // headers first block download, guarded by cs_main
+    uint256 hashBestKnownBlock;
+    int64 nTimeLastBlock;
+    int64 nTimeBlockStall;
+    int64 nTimeGetHeaders;
+    bool fHaveHeaders;
+    bool fSendCompact;
 
     // publish and subscription
     vector<char> vfSubscribe;
 
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) :
+        filterAddrKnown(5000, 0.001), filterInventoryKnown(nInventoryFilterSize, dInventoryFilterFPRate)
     {
         nServices = 0;
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
-        vRecv.SetType(SER_NETWORK);
+        nSendOffset = 0;
+        nRecvType = SER_NETWORK;
+        nRecvVersion = VERSION;
         nPushPos = -1;
         addr = addrIn;
         nVersion = 0;
@@ -483,9 +663,20 @@ public:
         fInbound = fInboundIn;
         fNetworkNode = false;
         fDisconnect = false;
+        fSendWait = false;
+        nTimeMessageComplete = 0;
         nRefCount = 0;
         nReleaseTime = 0;
+        nAskForInFlight = 0;
+        hashBestKnownBlock = 0;
+        nTimeLastBlock = 0;
+        nTimeBlockStall = 0;
+        nTimeGetHeaders = 0;
+        fHaveHeaders = false;
+        fSendCompact = false;
         vfSubscribe.assign(256, false);
+        if (hSocket != INVALID_SOCKET)
+            netreactor.Add(hSocket, this);
 
         // Push a version message
         /// when NTP implemented, change to just nTime = GetAdjustedTime()
@@ -530,34 +721,31 @@ public:
 
 
 
+    void ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+
+
     void AddInventoryKnown(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
     }
 
     void PushInventory(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
+
+        // Have the message handler offer it now rather than on its next poll
+        eventMessageHandler.Set();
     }
 
     void AskFor(const CInv& inv)
     {
-        // We're using mapAskFor as a priority queue,
-        // the key is the earliest time the request can be sent
-        int64& nRequestTime = mapAlreadyAskedFor[inv];
-        printf("askfor %s  %I64d\n", inv.ToString().c_str(), nRequestTime);
-
-        // Make sure not to reuse time indexes to keep things in the same order
-        int64 nNow = (GetTime() - 1) * 1000000;
-        static int64 nLastTime;
-        nLastTime = nNow = max(nNow, ++nLastTime);
-
-        // Each retry is 2 minutes after the last
-        nRequestTime = max(nRequestTime + 2 * 60 * 1000000, nNow);
-        mapAskFor.insert(make_pair(nRequestTime, inv));
+        // mapAskFor is a priority queue keyed by when to look at the item,
+        // SendMessages asks for it then unless another peer has it in flight
+        mapAskFor.insert(make_pair(GetTimeMicros(), inv));
+        eventMessageHandler.Set();
     }
 
 
@@ -604,10 +792,37 @@ public:
         //    printf("%02x ", vSend[i] & 0xff);
         printf("\n");
 
+        // Hand the finished message to the send queue without copying it
+        CSendBufferRef pbuf(new CSerializeData());
+        vSend.GetAndClear(*pbuf);
+        QueueSendBuffer(pbuf);
+
         nPushPos = -1;
         LeaveCriticalSection(&cs_vSend);
     }
 
+    void PushBuffer(const CSendBufferRef& pbuf)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            printf("sending: %-12.12s (%d bytes)  shared\n", &(*pbuf)[0] + offsetof(CMessageHeader, pchCommand), pbuf->size() - sizeof(CMessageHeader));
+            QueueSendBuffer(pbuf);
+        }
+    }
+
+    void QueueSendBuffer(const CSendBufferRef& pbuf)
+    {
+        // Caller holds cs_vSend
+        vSendMsg.push_back(pbuf);
+
+        // Have the socket handler tell us when it can be sent
+        if (!fSendWait && hSocket != INVALID_SOCKET)
+        {
+            fSendWait = true;
+            netreactor.SetWrite(hSocket, this, true);
+        }
+    }
+
     void EndMessageAbortIfEmpty()
     {
         if (nPushPos == -1)
@@ -792,8 +1007,9 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
+        // Save original serialized message so newer versions are preserved,
+        // framed once so every peer that asks shares the same buffer
+        mapRelay[inv] = MakeMessageBuffer(inv.GetCommand(), ss);
         vRelayExpiration.push_back(make_pair(GetTime() + 15 * 60, inv));
     }
 
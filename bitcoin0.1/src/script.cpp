@@ -1087,6 +1087,32 @@ bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret)
 }
 
 
+// Pay-to-pubkey and pay-to-hash160 outputs are both owned by a hash160
+bool ExtractOwnerHash160(const CScript& scriptPubKey, uint160& hash160Ret)
+{
+    hash160Ret = 0;
+
+    vector<pair<opcodetype, valtype> > vSolution;
+    if (!Solver(scriptPubKey, vSolution))
+        return false;
+
+    foreach(PAIRTYPE(opcodetype, valtype)& item, vSolution)
+    {
+        if (item.first == OP_PUBKEY)
+        {
+            hash160Ret = Hash160(item.second);
+            return true;
+        }
+        else if (item.first == OP_PUBKEYHASH)
+        {
+            hash160Ret = uint160(item.second);
+            return true;
+        }
+    }
+    return false;
+}
+
+
 bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, CScript scriptPrereq)
 {
     assert(nIn < txTo.vin.size());
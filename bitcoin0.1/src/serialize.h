@@ -688,6 +688,9 @@ struct secure_allocator : public std::allocator<T>
 
 
 
+// Serialized bytes that outlive the stream that built them
+typedef vector<char, secure_allocator<char> > CSerializeData;
+
 //
 // Double ended buffer combining vector and stream-like interfaces.
 // >> and << read and write unformatted data using the above serialization templates.
@@ -789,6 +792,7 @@ public:
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+    void GetAndClear(CSerializeData& data)           { vch.swap(data); CSerializeData().swap(vch); nReadPos = 0; }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
@@ -1149,3 +1153,123 @@ public:
         return (*this);
     }
 };
+
+
+
+
+
+
+
+
+//
+// Read-only stream over memory owned by someone else, like a mapped
+// file view.  Unserializes straight from the buffer without copying it.
+//
+class CMemoryStream
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryStream(const char* pbeginIn=NULL, const char* pendIn=NULL, int nTypeIn=SER_DISK, int nVersionIn=VERSION)
+    {
+        SetBuffer(pbeginIn, pendIn);
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        state = 0;
+        exceptmask = ios::badbit | ios::failbit;
+    }
+
+    void SetBuffer(const char* pbeginIn, const char* pendIn)
+    {
+        pbegin = pbeginIn;
+        pend = pendIn;
+        pcur = pbeginIn;
+    }
+
+    const char* begin() const    { return pcur; }
+    const char* end() const      { return pend; }
+    unsigned int size() const    { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    unsigned int tell() const    { return pcur - pbegin; }
+
+    bool seek(unsigned int nPos)
+    {
+        if (nPos > (unsigned int)(pend - pbegin))
+            return false;
+        pcur = pbegin + nPos;
+        return true;
+    }
+
+
+    //
+    // Stream subset
+    //
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            throw std::ios_base::failure(psz);
+    }
+
+    bool eof() const             { return empty(); }
+    bool fail() const            { return state & (ios::badbit | ios::failbit); }
+    bool good() const            { return !eof() && (state == 0); }
+    void clear(short n)          { state = n; }
+    short exceptions()           { return exceptmask; }
+    short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CMemoryStream"); return prev; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CMemoryStream& read(char* pch, int nSize)
+    {
+        // Read from the beginning of the buffer
+        assert(nSize >= 0);
+        if (nSize > pend - pcur)
+        {
+            setstate(ios::failbit, "CMemoryStream::read() : end of data");
+            memset(pch, 0, nSize);
+            nSize = pend - pcur;
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryStream& ignore(int nSize)
+    {
+        // Ignore from the beginning of the buffer
+        assert(nSize >= 0);
+        if (nSize > pend - pcur)
+        {
+            setstate(ios::failbit, "CMemoryStream::ignore() : end of data");
+            nSize = pend - pcur;
+        }
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CMemoryStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
@@ -22,6 +22,7 @@ map<string, string> mapAddressBook;
 
 
 void ThreadRequestProductDetails(void* parg);
+void ThreadRescanWallet(void* parg);
 void ThreadRandSendTest(void* parg);
 bool fRandSendTest = false;
 void RandSend();
@@ -349,6 +350,14 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        CloseBlockFile();
+
+        // StopNode waited for a background snapshot too, this one is last
+        CRITICAL_BLOCK(cs_main)
+        {
+            CTxDB txdb;
+            txdb.WriteBlockIndexSnapshot();
+        }
         DBFlush(true);
 
         printf("Bitcoin exiting\n");
@@ -441,7 +450,7 @@ void CMainFrame::InsertTransaction(const CWalletTx& wtx, bool fNew, int nIndex)
 
     // Find the block the tx is in
     CBlockIndex* pindex = NULL;
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
     if (mi != mapBlockIndex.end())
         pindex = (*mi).second;
 
@@ -625,6 +634,7 @@ void CMainFrame::RefreshStatus()
     if (nTop == nLastTop && pindexBestLast == pindexBest)
         return;
 
+    TRY_CRITICAL_BLOCK(cs_main)
     TRY_CRITICAL_BLOCK(cs_mapWallet)
     {
         int nStart = nTop;
@@ -670,6 +680,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
         // Collect list of wallet transactions and sort newest first
         bool fEntered = false;
         vector<pair<unsigned int, uint256> > vSorted;
+        TRY_CRITICAL_BLOCK(cs_main)
         TRY_CRITICAL_BLOCK(cs_mapWallet)
         {
             printf("RefreshListCtrl starting\n");
@@ -698,6 +709,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
             if (fShutdown)
                 return;
             bool fEntered = false;
+            TRY_CRITICAL_BLOCK(cs_main)
             TRY_CRITICAL_BLOCK(cs_mapWallet)
             {
                 fEntered = true;
@@ -718,6 +730,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
         static int64 nLastTime;
         if (GetTime() > nLastTime + 30)
         {
+            TRY_CRITICAL_BLOCK(cs_main)
             TRY_CRITICAL_BLOCK(cs_mapWallet)
             {
                 nLastTime = GetTime();
@@ -742,6 +755,7 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
     // Update listctrl contents
     if (!vWalletUpdated.empty())
     {
+        TRY_CRITICAL_BLOCK(cs_main)
         TRY_CRITICAL_BLOCK(cs_mapWallet)
         {
             pair<uint256, bool> item;
@@ -769,12 +783,16 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
         strGen = "    Generating";
     if (fGenerateBitcoins && vNodes.empty())
         strGen = "(not connected)";
+    int nRescanTotal = nRescanBlocksTotal;
+    if (nRescanTotal > 0)
+        strGen = strprintf("    Rescanning %d%%", 100 * nRescanBlocksDone / nRescanTotal);
     m_statusBar->SetStatusText(strGen, 1);
 
     string strStatus = strprintf("     %d connections     %d blocks     %d transactions", vNodes.size(), nBestHeight + 1, m_listCtrl->GetItemCount());
     m_statusBar->SetStatusText(strStatus, 2);
 
     // Balance total
+    TRY_CRITICAL_BLOCK(cs_main)
     TRY_CRITICAL_BLOCK(cs_mapWallet)
         m_staticTextBalance->SetLabel(FormatMoney(GetBalance()) + "  ");
 
@@ -973,208 +991,212 @@ CTxDetailsDialog::CTxDetailsDialog(wxWindow* parent, CWalletTx wtx) : CTxDetails
     string strHTML;
     strHTML.reserve(4000);
 
-    int64 nTime = wtx.GetTxTime();
-    int64 nCredit = wtx.GetCredit();
-    int64 nDebit = wtx.GetDebit();
-    int64 nNet = nCredit - nDebit;
+    // Depth, times and maturity come from the block index
+    CRITICAL_BLOCK(cs_main)
+    {
+        int64 nTime = wtx.GetTxTime();
+        int64 nCredit = wtx.GetCredit();
+        int64 nDebit = wtx.GetDebit();
+        int64 nNet = nCredit - nDebit;
 
 
 
 
-    strHTML += "<b>Status:</b> " + FormatTxStatus(wtx) + "<br>";
-    strHTML += "<b>Date:</b> " + (nTime ? DateTimeStr(nTime) : "") + "<br>";
+        strHTML += "<b>Status:</b> " + FormatTxStatus(wtx) + "<br>";
+        strHTML += "<b>Date:</b> " + (nTime ? DateTimeStr(nTime) : "") + "<br>";
 
 
-    //
-    // From
-    //
-    if (wtx.IsCoinBase())
-    {
-        strHTML += "<b>Source:</b> Generated<br>";
-    }
-    else if (!wtx.mapValue["from"].empty())
-    {
-        // Online transaction
-        if (!wtx.mapValue["from"].empty())
-            strHTML += "<b>From:</b> " + HtmlEscape(wtx.mapValue["from"]) + "<br>";
-    }
-    else
-    {
-        // Offline transaction
-        foreach(const CTxOut& txout, wtx.vout)
+        //
+        // From
+        //
+        if (wtx.IsCoinBase())
+        {
+            strHTML += "<b>Source:</b> Generated<br>";
+        }
+        else if (!wtx.mapValue["from"].empty())
         {
-            if (txout.IsMine())
+            // Online transaction
+            if (!wtx.mapValue["from"].empty())
+                strHTML += "<b>From:</b> " + HtmlEscape(wtx.mapValue["from"]) + "<br>";
+        }
+        else
+        {
+            // Offline transaction
+            foreach(const CTxOut& txout, wtx.vout)
             {
-                vector<unsigned char> vchPubKey;
-                if (ExtractPubKey(txout.scriptPubKey, true, vchPubKey))
+                if (txout.IsMine())
                 {
-                    string strAddress = PubKeyToAddress(vchPubKey);
-                    if (mapAddressBook.count(strAddress))
+                    vector<unsigned char> vchPubKey;
+                    if (ExtractPubKey(txout.scriptPubKey, true, vchPubKey))
                     {
-                        strHTML += "<b>Received with:</b> ";
-                        if (!mapAddressBook[strAddress].empty())
-                            strHTML += mapAddressBook[strAddress] + " ";
-                        strHTML += HtmlEscape(strAddress);
-                        strHTML += "<br>";
+                        string strAddress = PubKeyToAddress(vchPubKey);
+                        if (mapAddressBook.count(strAddress))
+                        {
+                            strHTML += "<b>Received with:</b> ";
+                            if (!mapAddressBook[strAddress].empty())
+                                strHTML += mapAddressBook[strAddress] + " ";
+                            strHTML += HtmlEscape(strAddress);
+                            strHTML += "<br>";
+                        }
                     }
+                    break;
                 }
-                break;
             }
         }
-    }
 
 
-    //
-    // To
-    //
-    string strAddress;
-    if (!wtx.mapValue["to"].empty())
-    {
-        // Online transaction
-        strAddress = wtx.mapValue["to"];
-        strHTML += "<b>To:</b> ";
-        if (mapAddressBook.count(strAddress) && !mapAddressBook[strAddress].empty())
-            strHTML += mapAddressBook[strAddress] + " ";
-        strHTML += HtmlEscape(strAddress) + "<br>";
-    }
-
-
-    //
-    // Amount
-    //
-    if (wtx.IsCoinBase() && nCredit == 0)
-    {
         //
-        // Coinbase
+        // To
         //
-        int64 nUnmatured = 0;
-        foreach(const CTxOut& txout, wtx.vout)
-            nUnmatured += txout.GetCredit();
-        if (wtx.IsInMainChain())
-            strHTML += strprintf("<b>Credit:</b> (%s matures in %d blocks)<br>", FormatMoney(nUnmatured).c_str(), wtx.GetBlocksToMaturity());
-        else
-            strHTML += "<b>Credit:</b> (not accepted)<br>";
-    }
-    else if (nNet > 0)
-    {
-        //
-        // Credit
-        //
-        strHTML += "<b>Credit:</b> " + FormatMoney(nNet) + "<br>";
-    }
-    else
-    {
-        bool fAllFromMe = true;
-        foreach(const CTxIn& txin, wtx.vin)
-            fAllFromMe = fAllFromMe && txin.IsMine();
+        string strAddress;
+        if (!wtx.mapValue["to"].empty())
+        {
+            // Online transaction
+            strAddress = wtx.mapValue["to"];
+            strHTML += "<b>To:</b> ";
+            if (mapAddressBook.count(strAddress) && !mapAddressBook[strAddress].empty())
+                strHTML += mapAddressBook[strAddress] + " ";
+            strHTML += HtmlEscape(strAddress) + "<br>";
+        }
 
-        bool fAllToMe = true;
-        foreach(const CTxOut& txout, wtx.vout)
-            fAllToMe = fAllToMe && txout.IsMine();
 
-        if (fAllFromMe)
+        //
+        // Amount
+        //
+        if (wtx.IsCoinBase() && nCredit == 0)
         {
             //
-            // Debit
+            // Coinbase
             //
+            int64 nUnmatured = 0;
             foreach(const CTxOut& txout, wtx.vout)
-            {
-                if (txout.IsMine())
-                    continue;
+                nUnmatured += txout.GetCredit();
+            if (wtx.IsInMainChain())
+                strHTML += strprintf("<b>Credit:</b> (%s matures in %d blocks)<br>", FormatMoney(nUnmatured).c_str(), wtx.GetBlocksToMaturity());
+            else
+                strHTML += "<b>Credit:</b> (not accepted)<br>";
+        }
+        else if (nNet > 0)
+        {
+            //
+            // Credit
+            //
+            strHTML += "<b>Credit:</b> " + FormatMoney(nNet) + "<br>";
+        }
+        else
+        {
+            bool fAllFromMe = true;
+            foreach(const CTxIn& txin, wtx.vin)
+                fAllFromMe = fAllFromMe && txin.IsMine();
 
-                string strAddress;
-                if (!wtx.mapValue["to"].empty())
+            bool fAllToMe = true;
+            foreach(const CTxOut& txout, wtx.vout)
+                fAllToMe = fAllToMe && txout.IsMine();
+
+            if (fAllFromMe)
+            {
+                //
+                // Debit
+                //
+                foreach(const CTxOut& txout, wtx.vout)
                 {
-                    // Online transaction
-                    strAddress = wtx.mapValue["to"];
+                    if (txout.IsMine())
+                        continue;
+
+                    string strAddress;
+                    if (!wtx.mapValue["to"].empty())
+                    {
+                        // Online transaction
+                        strAddress = wtx.mapValue["to"];
+                    }
+                    else
+                    {
+                        // Offline transaction
+                        uint160 hash160;
+                        if (ExtractHash160(txout.scriptPubKey, hash160))
+                            strAddress = Hash160ToAddress(hash160);
+                    }
+
+                    strHTML += "<b>Debit:</b> " + FormatMoney(-txout.nValue) + " &nbsp;&nbsp; ";
+                    strHTML += "(to ";
+                    if (mapAddressBook.count(strAddress) && !mapAddressBook[strAddress].empty())
+                        strHTML += mapAddressBook[strAddress] + " ";
+                    strHTML += strAddress;
+                    strHTML += ")<br>";
                 }
-                else
+
+                if (fAllToMe)
                 {
-                    // Offline transaction
-                    uint160 hash160;
-                    if (ExtractHash160(txout.scriptPubKey, hash160))
-                        strAddress = Hash160ToAddress(hash160);
+                    // Payment to self
+                    int64 nValue = wtx.vout[0].nValue;
+                    strHTML += "<b>Debit:</b> " + FormatMoney(-nValue) + "<br>";
+                    strHTML += "<b>Credit:</b> " + FormatMoney(nValue) + "<br>";
                 }
 
-                strHTML += "<b>Debit:</b> " + FormatMoney(-txout.nValue) + " &nbsp;&nbsp; ";
-                strHTML += "(to ";
-                if (mapAddressBook.count(strAddress) && !mapAddressBook[strAddress].empty())
-                    strHTML += mapAddressBook[strAddress] + " ";
-                strHTML += strAddress;
-                strHTML += ")<br>";
+                int64 nTxFee = nDebit - wtx.GetValueOut();
+                if (nTxFee > 0)
+                    strHTML += "<b>Transaction fee:</b> " + FormatMoney(-nTxFee) + "<br>";
             }
-
-            if (fAllToMe)
+            else
             {
-                // Payment to self
-                int64 nValue = wtx.vout[0].nValue;
-                strHTML += "<b>Debit:</b> " + FormatMoney(-nValue) + "<br>";
-                strHTML += "<b>Credit:</b> " + FormatMoney(nValue) + "<br>";
+                //
+                // Mixed debit transaction
+                //
+                foreach(const CTxIn& txin, wtx.vin)
+                    if (txin.IsMine())
+                        strHTML += "<b>Debit:</b> " + FormatMoney(-txin.GetDebit()) + "<br>";
+                foreach(const CTxOut& txout, wtx.vout)
+                    if (txout.IsMine())
+                        strHTML += "<b>Credit:</b> " + FormatMoney(txout.GetCredit()) + "<br>";
             }
-
-            int64 nTxFee = nDebit - wtx.GetValueOut();
-            if (nTxFee > 0)
-                strHTML += "<b>Transaction fee:</b> " + FormatMoney(-nTxFee) + "<br>";
         }
-        else
+
+        strHTML += "<b>Net amount:</b> " + FormatMoney(nNet, true) + "<br>";
+
+
+        //
+        // Message
+        //
+        if (!wtx.mapValue["message"].empty())
+            strHTML += "<br><b>Message:</b><br>" + HtmlEscape(wtx.mapValue["message"], true) + "<br>";
+
+
+        //
+        // Debug view
+        //
+        if (fDebug)
         {
-            //
-            // Mixed debit transaction
-            //
+            strHTML += "<hr><br>debug print<br><br>";
             foreach(const CTxIn& txin, wtx.vin)
                 if (txin.IsMine())
                     strHTML += "<b>Debit:</b> " + FormatMoney(-txin.GetDebit()) + "<br>";
             foreach(const CTxOut& txout, wtx.vout)
                 if (txout.IsMine())
                     strHTML += "<b>Credit:</b> " + FormatMoney(txout.GetCredit()) + "<br>";
-        }
-    }
-
-    strHTML += "<b>Net amount:</b> " + FormatMoney(nNet, true) + "<br>";
-
-
-    //
-    // Message
-    //
-    if (!wtx.mapValue["message"].empty())
-        strHTML += "<br><b>Message:</b><br>" + HtmlEscape(wtx.mapValue["message"], true) + "<br>";
-
 
-    //
-    // Debug view
-    //
-    if (fDebug)
-    {
-        strHTML += "<hr><br>debug print<br><br>";
-        foreach(const CTxIn& txin, wtx.vin)
-            if (txin.IsMine())
-                strHTML += "<b>Debit:</b> " + FormatMoney(-txin.GetDebit()) + "<br>";
-        foreach(const CTxOut& txout, wtx.vout)
-            if (txout.IsMine())
-                strHTML += "<b>Credit:</b> " + FormatMoney(txout.GetCredit()) + "<br>";
-
-        strHTML += "<b>Inputs:</b><br>";
-        CRITICAL_BLOCK(cs_mapWallet)
-        {
-            foreach(const CTxIn& txin, wtx.vin)
+            strHTML += "<b>Inputs:</b><br>";
+            CRITICAL_BLOCK(cs_mapWallet)
             {
-                COutPoint prevout = txin.prevout;
-                map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
-                if (mi != mapWallet.end())
+                foreach(const CTxIn& txin, wtx.vin)
                 {
-                    const CWalletTx& prev = (*mi).second;
-                    if (prevout.n < prev.vout.size())
+                    COutPoint prevout = txin.prevout;
+                    map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
+                    if (mi != mapWallet.end())
                     {
-                        strHTML += HtmlEscape(prev.ToString(), true);
-                        strHTML += " &nbsp;&nbsp; " + FormatTxStatus(prev) + ", ";
-                        strHTML = strHTML + "IsMine=" + (prev.vout[prevout.n].IsMine() ? "true" : "false") + "<br>";
+                        const CWalletTx& prev = (*mi).second;
+                        if (prevout.n < prev.vout.size())
+                        {
+                            strHTML += HtmlEscape(prev.ToString(), true);
+                            strHTML += " &nbsp;&nbsp; " + FormatTxStatus(prev) + ", ";
+                            strHTML = strHTML + "IsMine=" + (prev.vout[prevout.n].IsMine() ? "true" : "false") + "<br>";
+                        }
                     }
                 }
             }
-        }
 
-        strHTML += "<br><hr><br><b>Transaction:</b><br>";
-        strHTML += HtmlEscape(wtx.ToString(), true);
+            strHTML += "<br><hr><br><b>Transaction:</b><br>";
+            strHTML += HtmlEscape(wtx.ToString(), true);
+        }
     }
 
 
@@ -2714,7 +2736,13 @@ void CViewProductDialog::OnButtonCancel(wxCommandEvent& event)
 
 CViewOrderDialog::CViewOrderDialog(wxWindow* parent, CWalletTx order, bool fReceived) : CViewOrderDialogBase(parent)
 {
-    int64 nPrice = (fReceived ? order.GetCredit() : order.GetDebit());
+    int64 nPrice;
+    string strStatus;
+    CRITICAL_BLOCK(cs_main)
+    {
+        nPrice = (fReceived ? order.GetCredit() : order.GetDebit());
+        strStatus = FormatTxStatus(order);
+    }
 
     string strHTML;
     strHTML.reserve(4000);
@@ -2725,7 +2753,7 @@ CViewOrderDialog::CViewOrderDialog(wxWindow* parent, CWalletTx order, bool fRece
                "<body>\n";
     strHTML += "<b>Time:</b> "   + HtmlEscape(DateTimeStr(order.nTimeReceived)) + "<br>\n";
     strHTML += "<b>Price:</b> "  + HtmlEscape(FormatMoney(nPrice)) + "<br>\n";
-    strHTML += "<b>Status:</b> " + HtmlEscape(FormatTxStatus(order)) + "<br>\n";
+    strHTML += "<b>Status:</b> " + HtmlEscape(strStatus) + "<br>\n";
 
     strHTML += "<table>\n";
     for (int i = 0; i < order.vOrderForm.size(); i++)
@@ -2946,6 +2974,64 @@ bool CMyApp::OnInit2()
     if (mapArgs.count("/debug"))
         fDebug = true;
 
+    if (mapArgs.count("/blockfilesync"))
+    {
+        string strSync = mapArgs["/blockfilesync"];
+        if (strSync == "block")
+            nBlockFileSync = BLOCKFILESYNC_BLOCK;
+        else if (strSync == "periodic")
+            nBlockFileSync = BLOCKFILESYNC_PERIODIC;
+        else
+            nBlockFileSync = BLOCKFILESYNC_NONE;
+    }
+    if (mapArgs.count("/logdbsync"))
+    {
+        string strSync = mapArgs["/logdbsync"];
+        if (strSync == "block")
+            nLogDBSync = BLOCKFILESYNC_BLOCK;
+        else if (strSync == "periodic")
+            nLogDBSync = BLOCKFILESYNC_PERIODIC;
+        else
+            nLogDBSync = BLOCKFILESYNC_NONE;
+    }
+
+    // Sizes in megabytes, file positions are 32-bit and a file must hold
+    // the largest block
+    if (mapArgs.count("/blockfilesize"))
+        nBlockFileMaxSize = max(min(atoi64(mapArgs["/blockfilesize"]) * 1024 * 1024, (int64)0xF0000000), (int64)MAX_SIZE + 1024 * 1024);
+    if (mapArgs.count("/blockfileprealloc"))
+        nBlockFilePrealloc = max(min(atoi64(mapArgs["/blockfileprealloc"]) * 1024 * 1024, (int64)256 * 1024 * 1024), (int64)0);
+    if (mapArgs.count("/txdb"))
+        nTxDBStore = (mapArgs["/txdb"] == "log" ? DBSTORE_LOG : DBSTORE_BDB);
+    if (mapArgs.count("/dbcache"))
+        nDBCacheSize = (int64)max(min(atoi(mapArgs["/dbcache"]), 4096), 1) * 1024 * 1024;
+    if (mapArgs.count("/dblocks"))
+        nDBMaxLocks = max(atoi(mapArgs["/dblocks"]), 1000);
+    if (mapArgs.count("/dblogsize"))
+        nDBLogFileSize = max(min(atoi(mapArgs["/dblogsize"]), 1024), 1) * 1024 * 1024;
+    if (mapArgs.count("/blockcache"))
+        nBlockMessageCacheSize = (int64)max(min(atoi(mapArgs["/blockcache"]), 1024), 1) * 1024 * 1024;
+    if (mapArgs.count("/msgthreads"))
+        nMessageThreads = max(min(atoi(mapArgs["/msgthreads"]), MAX_MESSAGE_THREADS), 1);
+    if (mapArgs.count("/invfilter"))
+        nInventoryFilterSize = max(min(atoi(mapArgs["/invfilter"]), 1000000), 1000);
+    if (mapArgs.count("/invfprate"))
+        dInventoryFilterFPRate = max(min(atof(mapArgs["/invfprate"].c_str()), 0.01), 0.000000001);
+    if (mapArgs.count("/msgbatch"))
+        nMessageBatchMillis = max(min(atoi(mapArgs["/msgbatch"]), 1000), 0);
+    if (mapArgs.count("/netstats"))
+        nNetStatsInterval = (mapArgs["/netstats"].empty() ? 600 : atoi(mapArgs["/netstats"]));
+    if (mapArgs.count("/dbstats"))
+        nDBStatsInterval = (mapArgs["/dbstats"].empty() ? 600 : atoi(mapArgs["/dbstats"]));
+    if (mapArgs.count("/dbcheckpointinterval"))
+        nDBCheckpointInterval = max(atoi(mapArgs["/dbcheckpointinterval"]), 1);
+    if (mapArgs.count("/dbcheckpointlog"))
+        nDBCheckpointLogSize = max(min(atoi(mapArgs["/dbcheckpointlog"]), 1024), 1) * 1024 * 1024;
+    if (mapArgs.count("/dblogarchivedir"))
+        strDBLogArchiveDir = mapArgs["/dblogarchivedir"];
+    if (mapArgs.count("/rescanthreads"))
+        nRescanThreads = max(1, min(atoi(mapArgs["/rescanthreads"]), 32));
+
     if (mapArgs.count("/dropmessages"))
     {
         nDropMessagesTest = atoi(mapArgs["/dropmessages"]);
@@ -2981,6 +3067,13 @@ bool CMyApp::OnInit2()
     QueryPerformanceCounter((LARGE_INTEGER*)&nEnd);
     printf(" block index %20I64d\n", nEnd - nStart);
 
+    if (mapArgs.count("/rebuildownerindex") && !fClient && strErrors.empty())
+    {
+        printf("Rebuilding owner index...\n");
+        if (!RebuildOwnerIndex())
+            strErrors += "Error rebuilding owner index      \n";
+    }
+
     printf("Loading wallet...\n");
     QueryPerformanceCounter((LARGE_INTEGER*)&nStart);
     if (!LoadWallet())
@@ -2988,6 +3081,14 @@ bool CMyApp::OnInit2()
     QueryPerformanceCounter((LARGE_INTEGER*)&nEnd);
     printf(" wallet      %20I64d\n", nEnd - nStart);
 
+#ifdef TESTDBSTORE
+    if (mapArgs.count("/benchdbstore"))
+    {
+        BenchmarkDBStore(mapArgs["/benchdbstore"].empty() ? 20000 : atoi(mapArgs["/benchdbstore"]));
+        ExitProcess(0);
+    }
+#endif
+
     printf("Done loading\n");
 
         //// debug print
@@ -3040,6 +3141,11 @@ bool CMyApp::OnInit2()
             if (_beginthread(ThreadBitcoinMiner, 0, NULL) == -1)
                 printf("Error: _beginthread(ThreadBitcoinMiner) failed\n");
 
+        // Rescan in the background with progress in the status bar
+        if (mapArgs.count("/rescan") && !fClient)
+            if (_beginthread(ThreadRescanWallet, 0, (void*)(size_t)atoi(mapArgs["/rescan"])) == -1)
+                printf("Error: _beginthread(ThreadRescanWallet) failed\n");
+
         //
         // Tests
         //
@@ -3155,6 +3261,20 @@ void MainFrameRepaint()
 
 
 
+void ThreadRescanWallet(void* parg)
+{
+    int nStartHeight = (int)(size_t)parg;
+    printf("Rescanning for wallet transactions...\n");
+    if (!ScanForWalletTransactions(nStartHeight))
+        printf("ThreadRescanWallet() : error rescanning block chain\n");
+}
+
+
+
+
+
+
+
 // randsendtest to bitcoin address
 void ThreadRandSendTest(void* parg)
 {
@@ -352,6 +352,11 @@ public:
         return sizeof(pn);
     }
 
+    uint64 Get64(int n=0) const
+    {
+        return pn[2*n] | (uint64)pn[2*n+1] << 32;
+    }
+
 
     unsigned int GetSerializeSize(int nType=0, int nVersion=VERSION) const
     {
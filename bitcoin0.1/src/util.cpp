@@ -332,6 +332,18 @@ int64 GetTime()
     return time(NULL);
 }
 
+int64 GetTimeMicros()
+{
+    // High resolution timer for measuring, not for telling the time
+    LARGE_INTEGER nCounter, nFrequency;
+    QueryPerformanceCounter(&nCounter);
+    QueryPerformanceFrequency(&nFrequency);
+    if (nFrequency.QuadPart == 0)
+        return GetTime() * 1000000;
+    return (nCounter.QuadPart / nFrequency.QuadPart) * 1000000 +
+           (nCounter.QuadPart % nFrequency.QuadPart) * 1000000 / nFrequency.QuadPart;
+}
+
 static int64 nTimeOffset = 0;
 
 int64 GetAdjustedTime()
@@ -371,3 +383,128 @@ void AddTimeData(unsigned int ip, int64 nTime)
         printf("|  nTimeOffset = %+I64d  (%+I64d minutes)\n", nTimeOffset, nTimeOffset/60);
     }
 }
+
+
+
+
+
+
+
+
+
+
+//
+// CRollingBloomFilter
+//
+
+static inline unsigned int ROTL32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int CRollingBloomFilter::HashKey(unsigned int nHashNum, const unsigned char* pch, unsigned int nSize) const
+{
+    // MurmurHash3, a different seed for each hash function
+    unsigned int h1 = nHashNum * 0xFBA4C795 + nTweak;
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    unsigned int nBlocks = nSize / 4;
+    for (unsigned int i = 0; i < nBlocks; i++)
+    {
+        unsigned int k1 = pch[4*i] | (pch[4*i+1] << 8) | (pch[4*i+2] << 16) | (pch[4*i+3] << 24);
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    const unsigned char* tail = pch + nBlocks * 4;
+    unsigned int k1 = 0;
+    switch (nSize & 3)
+    {
+    case 3: k1 ^= tail[2] << 16;
+    case 2: k1 ^= tail[1] << 8;
+    case 1: k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= nSize;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double dFPRate)
+{
+    // Optimal number of hash functions and bits for the rate, sized for
+    // the three generations that can be in at once
+    double dLogFPRate = log(dFPRate);
+    nHashFuncs = max(1, min((int)(dLogFPRate / log(0.5) + 0.5), 50));
+    nEntriesPerGeneration = max((nElements + 1) / 2, (unsigned int)1);
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(dLogFPRate / nHashFuncs)));
+    vData.resize(((nFilterBits + 63) / 64) * 2);
+    clear();
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, unsigned int nSize)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        if (++nGeneration == 4)
+            nGeneration = 1;
+
+        // Wipe the cells of the generation number we're about to reuse
+        uint64 nMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nMask2 = 0 - (uint64)(nGeneration >> 1);
+        for (unsigned int i = 0; i < vData.size(); i += 2)
+        {
+            uint64 p1 = vData[i];
+            uint64 p2 = vData[i+1];
+            uint64 nKeep = (p1 ^ nMask1) | (p2 ^ nMask2);
+            vData[i] = p1 & nKeep;
+            vData[i+1] = p2 & nKeep;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = HashKey(n, pch, nSize);
+        int nBit = h & 0x3F;
+        unsigned int nPos = (unsigned int)(((uint64)h * vData.size()) >> 32) & ~1;
+        vData[nPos]   = (vData[nPos]   & ~((uint64)1 << nBit)) | ((uint64)(nGeneration & 1) << nBit);
+        vData[nPos+1] = (vData[nPos+1] & ~((uint64)1 << nBit)) | ((uint64)(nGeneration >> 1) << nBit);
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, unsigned int nSize) const
+{
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = HashKey(n, pch, nSize);
+        int nBit = h & 0x3F;
+        unsigned int nPos = (unsigned int)(((uint64)h * vData.size()) >> 32) & ~1;
+        if (!(((vData[nPos] | vData[nPos+1]) >> nBit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::clear()
+{
+    nTweak = (unsigned int)GetRand(UINT_MAX);
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    fill(vData.begin(), vData.end(), 0);
+}
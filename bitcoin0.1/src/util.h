@@ -80,6 +80,7 @@ bool FileExists(const char* psz);
 int GetFilesize(FILE* file);
 uint64 GetRand(uint64 nMax);
 int64 GetTime();
+int64 GetTimeMicros();
 int64 GetAdjustedTime();
 void AddTimeData(unsigned int ip, int64 nTime);
 
@@ -111,6 +112,21 @@ public:
     CRITICAL_SECTION* operator&() { return &cs; }
 };
 
+// Auto-reset event, Set() wakes a thread in Wait() or the next one to call it
+class CWakeEvent
+{
+protected:
+    HANDLE hEvent;
+public:
+    explicit CWakeEvent() { hEvent = CreateEvent(NULL, FALSE, FALSE, NULL); }
+    ~CWakeEvent() { CloseHandle(hEvent); }
+    void Set() { SetEvent(hEvent); }
+    bool Wait(int nMillis) { return WaitForSingleObject(hEvent, nMillis) == WAIT_OBJECT_0; }
+private:
+    CWakeEvent(const CWakeEvent&);
+    void operator=(const CWakeEvent&);
+};
+
 // Automatically leave critical section when leaving block, needed for exception safety
 class CCriticalBlock
 {
@@ -397,3 +413,48 @@ inline uint160 Hash160(const vector<unsigned char>& vch)
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
 }
+
+
+
+
+
+
+
+
+
+//
+// Remembers about the last nElements keys put in, in fixed memory.  The
+// filter is three generations of nElements/2 keys, when one fills the
+// oldest is wiped, so a key stays in for at least nElements/2 inserts.
+// contains() is true for keys never inserted with about dFPRate odds.
+//
+class CRollingBloomFilter
+{
+protected:
+    // Two bits per cell, spread over pairs of words: which generation
+    // set it, or 0 for empty
+    vector<uint64> vData;
+    unsigned int nHashFuncs;
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    unsigned int nTweak;
+
+    unsigned int HashKey(unsigned int nHashNum, const unsigned char* pch, unsigned int nSize) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double dFPRate);
+    void insert(const unsigned char* pch, unsigned int nSize);
+    bool contains(const unsigned char* pch, unsigned int nSize) const;
+    void clear();
+
+    void insert(const uint256& hash)                 { insert((unsigned char*)&hash, sizeof(hash)); }
+    void insert(const vector<unsigned char>& vch)    { insert(vch.empty() ? NULL : &vch[0], vch.size()); }
+    bool contains(const uint256& hash) const         { return contains((unsigned char*)&hash, sizeof(hash)); }
+    bool contains(const vector<unsigned char>& vch) const { return contains(vch.empty() ? NULL : &vch[0], vch.size()); }
+
+    unsigned int GetMemoryUsage() const
+    {
+        return sizeof(*this) + vData.size() * sizeof(vData[0]);
+    }
+};